@@ -5,7 +5,20 @@
 #include <sstream>
 #include <utility>
 #include <map>
+#include <functional>
 #include <string>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using std::string, std::cout, std::cerr, std::endl;
 
@@ -41,48 +54,372 @@ string shift_vector(std::vector<string> &vec)
     exit(1);
 }
 
-int test_file(const string &file_path) {
-    string file_name = file_path.substr(0, file_path.find_last_of('.'));
+enum class TestStatus
+{
+    PASSED,
+    SKIPPED,
+    FAILED,
+    TIMED_OUT,
+};
 
-    string output_path = file_name + ".output";
+enum class TestPhase
+{
+    WAITING,
+    ACTIVE,
+    DONE,
+};
 
-    if (!is_file_exists(output_path))
+class Process
+{
+public:
+    pid_t Pid = -1;
+    int Fds[2] = {-1, -1};
+    int ExitFd = -1;
+    string Output[2];
+    int Status = 0;
+    std::chrono::steady_clock::time_point StartedAt;
+};
+
+// A compilation or a run of a test. Every run is checked against the recorded output and the expected
+// exit code
+class TestStep
+{
+public:
+    string Name;
+    string Command;
+    bool IsRun;
+    double Seconds = 0;
+};
+
+class Test
+{
+public:
+    string FilePath;
+    string ExpectedOutput;
+    string Directory;
+    TestPhase Phase = TestPhase::WAITING;
+    TestStatus Status = TestStatus::PASSED;
+    std::vector<TestStep> Steps;
+    size_t Step = 0;
+    Process Current;
+    std::chrono::steady_clock::time_point StartedAt;
+    int ExitCode = 0;
+    explicit Test(string file_path) : FilePath(std::move(file_path)) {}
+};
+
+// Runs `command` through the shell in a process group of its own, so a timeout kills everything it started.
+// Standard output and error are read from `Fds`, and `ExitFd` becomes readable once the process exits
+Process start_process(const string &command)
+{
+    Process process;
+    int out[2], err[2];
+    if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0)
     {
-        cout << "[INFO] Skipping test for file: " << file_path << ". No recorded output found" << endl;
-        return 1;
+        cerr << "[ERROR] Can't create a pipe for command: " << command << endl;
+        exit(1);
     }
 
-    string command = "./wis -quiet " + file_path + " && ./" + file_name;
+    cout.flush();
+    cerr.flush();
+    process.StartedAt = std::chrono::steady_clock::now();
+    process.Pid = fork();
+    if (process.Pid < 0)
+    {
+        cerr << "[ERROR] Can't start command: " << command << endl;
+        exit(1);
+    }
 
-    FILE* pipe = popen(command.c_str(), "r");
-    if (!pipe) {
-        cerr << "ERROR: Command execution failed: " << command << endl;
-        return -1;
+    if (process.Pid == 0)
+    {
+        setpgid(0, 0);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", ("exec " + command).c_str(), nullptr);
+        _exit(127);
+    }
+
+    setpgid(process.Pid, process.Pid);
+    process.ExitFd = int(syscall(SYS_pidfd_open, process.Pid, 0));
+    close(out[1]);
+    close(err[1]);
+    process.Fds[0] = out[0];
+    process.Fds[1] = err[0];
+    return process;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+string escape_json(const string &text)
+{
+    std::ostringstream result;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\') result << '\\' << c;
+        else if (c == '\n') result << "\\n";
+        else if (static_cast<unsigned char>(c) < 0x20) result << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+        else result << c;
     }
+    return result.str();
+}
+
+void write_report(const string &report_path, const std::vector<Test> &tests, int passed, int skipped, int failed)
+{
+    static const char* statuses[] = {"passed", "skipped", "failed", "timeout"};
+
+    std::ofstream report(report_path);
+    if (!report)
+    {
+        cerr << "[ERROR] Can't write test report to: " << report_path << endl;
+        exit(1);
+    }
+
+    report << "{\n  \"passed\": " << passed << ",\n  \"skipped\": " << skipped << ",\n  \"failed\": " << failed << ",\n  \"tests\": [";
+    for (size_t i = 0; i < tests.size(); ++i)
+    {
+        const Test &test = tests[i];
+        report << (i == 0 ? "\n" : ",\n") << "    {\"file\": \"" << escape_json(test.FilePath) << "\", "
+               << "\"status\": \"" << statuses[static_cast<int>(test.Status)] << "\", "
+               << "\"seconds\": {";
+        for (size_t k = 0; k < test.Steps.size(); ++k)
+        {
+            report << (k == 0 ? "" : ", ") << "\"" << escape_json(test.Steps[k].Name) << "\": " << test.Steps[k].Seconds;
+        }
+        report << "}}";
+    }
+    report << "\n  ]\n}\n";
+}
+
+// Directives in the comments at the top of a test: `// flags: <compiler flags>` and `// exit: <code>`
+string test_directive(const string &file_path, const string &name)
+{
+    const string prefix = "// " + name + ":";
+
+    std::ifstream file(file_path);
+    string line;
+    while (std::getline(file, line) && line.compare(0, 2, "//") == 0)
+    {
+        if (line.compare(0, prefix.size(), prefix) == 0) return line.substr(prefix.size());
+    }
+    return "";
+}
+
+string test_flags(const string &file_path)
+{
+    return test_directive(file_path, "flags") + " ";
+}
+
+int exit_code(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Builds the test in its own temporary directory, so tests running at the same time don't share
+// `.asm`, `.o` and executable files. Besides the executable, the interpreter, the JIT and the executable
+// optimized with `-O` are checked
+void start_test(Test &test)
+{
+    string expected_path = test.FilePath.substr(0, test.FilePath.find_last_of('.')) + ".output";
+    if (!is_file_exists(expected_path))
+    {
+        test.Status = TestStatus::SKIPPED;
+        test.Phase = TestPhase::DONE;
+        return;
+    }
+
+    std::ifstream expected_file(expected_path);
+    test.ExpectedOutput.assign(std::istreambuf_iterator<char>(expected_file), std::istreambuf_iterator<char>());
+
+    string directory = (std::filesystem::temp_directory_path() / "wis-test-XXXXXX").string();
+    if (mkdtemp(directory.data()) == nullptr)
+    {
+        cerr << "[ERROR] Can't create temporary directory for test: " << test.FilePath << endl;
+        exit(1);
+    }
+    test.Directory = directory;
+    test.StartedAt = std::chrono::steady_clock::now();
+
+    string source = test.Directory + "/" + std::filesystem::path(test.FilePath).filename().string();
+    string executable = test.Directory + "/" + std::filesystem::path(test.FilePath).stem().string();
+    std::filesystem::copy_file(test.FilePath, source);
+
+    string expected_exit_code = test_directive(source, "exit");
+    test.ExitCode = expected_exit_code.empty() ? 0 : atoi(expected_exit_code.c_str());
+
+    string compiler = "./wis -quiet " + test_flags(source);
+    test.Steps = {
+        {"compile", compiler + source, false},
+        {"run", executable, true},
+        {"interpret", compiler + "-interpret " + source, true},
+        {"jit", compiler + "-jit " + source, true},
+        {"compile -O", compiler + "-O " + source, false},
+        {"run -O", executable, true},
+    };
+
+    test.Current = start_process(test.Steps[0].Command);
+    test.Phase = TestPhase::ACTIVE;
+}
+
+void finish_step(Test &test)
+{
+    Process &process = test.Current;
+    TestStep &step = test.Steps[test.Step];
+    step.Seconds = seconds_since(process.StartedAt);
+
+    if (test.Status == TestStatus::PASSED && !step.IsRun && exit_code(process.Status) != 0) test.Status = TestStatus::FAILED;
+    if (test.Status == TestStatus::PASSED && step.IsRun)
+    {
+        if (process.Output[0] != test.ExpectedOutput || exit_code(process.Status) != test.ExitCode) test.Status = TestStatus::FAILED;
+    }
+
+    if (test.Status == TestStatus::PASSED && ++test.Step < test.Steps.size())
+    {
+        test.Current = start_process(test.Steps[test.Step].Command);
+        return;
+    }
+
+    std::filesystem::remove_all(test.Directory);
+    test.Phase = TestPhase::DONE;
+}
+
+void print_test_result(const Test &test)
+{
+    switch (test.Status)
+    {
+        case TestStatus::SKIPPED:
+            cout << "[INFO] Skipping test for file: " << test.FilePath << ". No recorded output found" << endl;
+            break;
+        case TestStatus::PASSED:
+        {
+            cout << "[INFO] Test passed for file: " << test.FilePath << std::fixed << std::setprecision(3);
+            for (size_t i = 0; i < test.Steps.size(); ++i) cout << (i == 0 ? " (" : ", ") << test.Steps[i].Name << " " << test.Steps[i].Seconds << "s";
+            cout << ")" << std::defaultfloat << endl;
+            break;
+        }
+        case TestStatus::TIMED_OUT:
+            cerr << "[ERROR] Test timed out for file: " << test.FilePath << " at step: " << test.Steps[test.Step].Name << endl;
+            break;
+        case TestStatus::FAILED:
+        {
+            const TestStep &step = test.Steps[test.Step];
+            const Process &process = test.Current;
+            cerr << "[ERROR] Test failed for file: " << test.FilePath << " at step: " << step.Name << endl;
+            if (!step.IsRun)
+            {
+                cerr << "  Compiler output:\n" << process.Output[0] << process.Output[1] << endl;
+                break;
+            }
+
+            cerr << "  Expected output:\n" << test.ExpectedOutput << "\n  Actual output:\n" << process.Output[0] << endl;
+            if (exit_code(process.Status) != test.ExitCode) cerr << "  Expected exit code " << test.ExitCode << ", but got " << exit_code(process.Status) << endl;
+            if (!process.Output[1].empty()) cerr << "  Errors:\n" << process.Output[1] << endl;
+            break;
+        }
+    }
+}
+
+void write_file(const string &path, const string &content)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << content;
+}
+
+string read_command_output(const string &command)
+{
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe) return "";
 
     string output;
     char buffer[128];
     while (fgets(buffer, sizeof(buffer), pipe) != nullptr) output += buffer;
-
     pclose(pipe);
+    return output;
+}
 
-    std::ifstream outputFile(output_path);
-    string expected_output((std::istreambuf_iterator<char>(outputFile)), std::istreambuf_iterator<char>());
-
-    if (output == expected_output) {
-        cout << "[INFO] Test passed for file: " << file_path << endl;
-        return 0;
-    } else {
-        cerr << "[ERROR] Test failed for file: " << file_path << endl;
-        cerr << "  Expected output:\n" << expected_output << "\n  Actual output:\n" << output << endl;
-        return -1;
+std::vector<string> cache_entries(const string &directory)
+{
+    std::vector<string> entries;
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (it->is_regular_file()) entries.push_back(it->path().string());
     }
+    return entries;
+}
+
+// Module cache scenarios. Each one compiles a program using a library file, with a cache directory of its
+// own, and changes the library or the cache between compilations. Both compilations must print the output
+// of the library as it is
+std::vector<Test> test_module_cache()
+{
+    std::vector<Test> results;
+
+    auto check = [&results](const string &name, const std::function<bool(const string&)> &scenario) {
+        string directory = (std::filesystem::temp_directory_path() / "wis-cache-test-XXXXXX").string();
+        if (mkdtemp(directory.data()) == nullptr)
+        {
+            cerr << "[ERROR] Can't create temporary directory for cache test: " << name << endl;
+            exit(1);
+        }
+        std::filesystem::create_directory(directory + "/use");
+        write_file(directory + "/main.wis", "use \"std.wis\"\nuse \"lib.wis\"\nvalue put\n");
+        write_file(directory + "/use/lib.wis", "bind value 1 end\n");
+
+        Test &result = results.emplace_back("cache: " + name);
+        result.Status = scenario(directory) ? TestStatus::PASSED : TestStatus::FAILED;
+        std::filesystem::remove_all(directory);
+
+        if (result.Status == TestStatus::PASSED) cout << "[INFO] Test passed for module cache: " << name << endl;
+        else cerr << "[ERROR] Test failed for module cache: " << name << endl;
+    };
+
+    auto compile_and_run = [](const string &directory, const string &environment) {
+        return read_command_output(environment + " ./wis -quiet -I " + directory + "/use/ " + directory + "/main.wis && " + directory + "/main");
+    };
+
+    check("used file edited between compilations", [&](const string &directory) {
+        string environment = "WIS_CACHE_DIR=" + directory + "/cache";
+        if (compile_and_run(directory, environment) != "1\n" || cache_entries(directory + "/cache").empty()) return false;
+
+        write_file(directory + "/use/lib.wis", "bind value 2 end\n");
+        return compile_and_run(directory, environment) == "2\n";
+    });
+
+    check("damaged and truncated entries", [&](const string &directory) {
+        string environment = "WIS_CACHE_DIR=" + directory + "/cache";
+        if (compile_and_run(directory, environment) != "1\n") return false;
+
+        std::vector<string> entries = cache_entries(directory + "/cache");
+        if (entries.empty()) return false;
+        for (const string &entry : entries)
+        {
+            std::fstream file(entry, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(std::streamoff(std::filesystem::file_size(entry) / 2));
+            file << "damaged";
+        }
+        if (compile_and_run(directory, environment) != "1\n") return false;
+
+        for (const string &entry : cache_entries(directory + "/cache")) std::filesystem::resize_file(entry, std::filesystem::file_size(entry) / 2);
+        return compile_and_run(directory, environment) == "1\n";
+    });
+
+    check("empty WIS_CACHE_DIR", [&](const string &directory) {
+        string environment = "WIS_CACHE_DIR= XDG_CACHE_HOME=" + directory + "/cache HOME=" + directory + "/home";
+        return compile_and_run(directory, environment) == "1\n" && cache_entries(directory + "/cache").empty() && cache_entries(directory + "/home").empty();
+    });
+
+    return results;
 }
 
 void run_tests(std::vector<string> args, std::vector<string> paths)
 {
-    int i = 0;
-    while (i < args.size())
+    int jobs = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+    int timeout = 30;
+    string report_path;
+
+    while (!args.empty())
     {
         string arg = shift_vector(args);
         if (arg == "-f")
@@ -93,36 +430,157 @@ void run_tests(std::vector<string> args, std::vector<string> paths)
                 exit(1);
             }
 
-            paths.push_back(args[0]);
+            paths.push_back(shift_vector(args));
         }
-    }
+        else if (arg == "-j" || arg == "-timeout")
+        {
+            int value = args.empty() ? -1 : atoi(args[0].c_str());
+            if (value < (arg == "-j" ? 1 : 0))
+            {
+                cerr << "[ERROR] number not found after `" << arg << "` flag" << endl;
+                exit(1);
+            }
 
-    int failed = 0;
-    int passed = 0;
-    int skipped = 0;
+            shift_vector(args);
+            if (arg == "-j") jobs = value;
+            else timeout = value;
+        }
+        else if (arg == "-report")
+        {
+            if (args.empty())
+            {
+                cerr << "[ERROR] path to report not found after `-report` flag" << endl;
+                exit(1);
+            }
 
+            report_path = shift_vector(args);
+        }
+        else
+        {
+            cerr << "[ERROR] unknown flag provided: " << arg << endl;
+            exit(1);
+        }
+    }
+
+    std::vector<Test> tests;
     for (const auto &path : paths)
     {
+        std::vector<string> files;
         for (const auto &entry : std::filesystem::directory_iterator(path)) {
-            if (entry.path().extension() == FILE_EXTENSION) {
-                int result = test_file(entry.path().string());
+            if (entry.path().extension() == FILE_EXTENSION) files.push_back(entry.path().string());
+        }
+        std::sort(files.begin(), files.end());
+        for (const auto &file : files) tests.emplace_back(file);
+    }
+
+    size_t started = 0;
+    size_t printed = 0;
+    int running = 0;
+
+    while (printed < tests.size())
+    {
+        while (running < jobs && started < tests.size())
+        {
+            start_test(tests[started++]);
+            if (tests[started - 1].Phase != TestPhase::DONE) ++running;
+        }
 
-                if (result == -1) failed++;
-                else if (result == 1) skipped++;
-                else passed++;
+        std::vector<pollfd> fds;
+        std::vector<std::pair<size_t, int>> owners;
+        int wait_ms = -1;
+        for (size_t k = printed; k < started; ++k)
+        {
+            Test &test = tests[k];
+            if (test.Phase == TestPhase::DONE) continue;
+
+            Process &process = test.Current;
+            if (timeout > 0 && seconds_since(test.StartedAt) >= timeout)
+            {
+                kill(-process.Pid, SIGKILL);
+                test.Status = TestStatus::TIMED_OUT;
+            }
+
+            for (int stream = 0; stream < 2; ++stream)
+            {
+                if (process.Fds[stream] < 0) continue;
+                if (test.Status == TestStatus::TIMED_OUT)
+                {
+                    close(process.Fds[stream]);
+                    process.Fds[stream] = -1;
+                    continue;
+                }
+                fds.push_back({process.Fds[stream], POLLIN, 0});
+                owners.emplace_back(k, stream);
             }
+
+            // A process may close its output before exiting, so it's waited for until it's gone
+            if (process.Fds[0] < 0 && process.Fds[1] < 0)
+            {
+                int options = test.Status == TestStatus::TIMED_OUT ? 0 : WNOHANG;
+                if (waitpid(process.Pid, &process.Status, options) == process.Pid)
+                {
+                    if (process.ExitFd >= 0) close(process.ExitFd);
+                    finish_step(test);
+                    if (test.Phase == TestPhase::DONE) --running;
+                    wait_ms = 0;
+                    continue;
+                }
+
+                if (process.ExitFd < 0) wait_ms = 1;
+                else
+                {
+                    fds.push_back({process.ExitFd, POLLIN, 0});
+                    owners.emplace_back(k, 2);
+                }
+            }
+
+            if (timeout > 0)
+            {
+                int left_ms = std::max(0, int((timeout - seconds_since(test.StartedAt)) * 1000) + 1);
+                wait_ms = wait_ms < 0 ? left_ms : std::min(wait_ms, left_ms);
+            }
+        }
+
+        if (!fds.empty() || wait_ms > 0) poll(fds.data(), fds.size(), wait_ms);
+
+        for (size_t f = 0; f < fds.size(); ++f)
+        {
+            auto [k, stream] = owners[f];
+            if (fds[f].revents == 0 || stream == 2) continue;
+
+            Process &process = tests[k].Current;
+            char buffer[4096];
+            ssize_t size = read(process.Fds[stream], buffer, sizeof(buffer));
+            if (size > 0)
+            {
+                process.Output[stream].append(buffer, size_t(size));
+                continue;
+            }
+
+            close(process.Fds[stream]);
+            process.Fds[stream] = -1;
         }
+
+        for (; printed < started && tests[printed].Phase == TestPhase::DONE; ++printed) print_test_result(tests[printed]);
     }
 
-    cout << endl << "Testing report:" << endl;
-    cout << "  Tests passed: " << passed << ", Tests skipped: " << skipped << ", Tests failed: " << failed << endl;
+    for (Test &result : test_module_cache()) tests.push_back(std::move(result));
 
-    for (auto const &path: paths)
+    int failed = 0;
+    int passed = 0;
+    int skipped = 0;
+    for (const auto &test : tests)
     {
-        execute_command(true, "rm " + path + "/*.asm");
-        execute_command(true, "rm " + path + "/*.o");
+        if (test.Status == TestStatus::PASSED) passed++;
+        else if (test.Status == TestStatus::SKIPPED) skipped++;
+        else failed++;
     }
 
+    cout << endl << "Testing report:" << endl;
+    cout << "  Tests passed: " << passed << ", Tests skipped: " << skipped << ", Tests failed: " << failed << endl;
+
+    if (!report_path.empty()) write_report(report_path, tests, passed, skipped, failed);
+
     if (failed > 0) exit(1);
 }
 
@@ -130,7 +588,7 @@ void record_test_output(string const &file_path)
 {
     string file_name = file_path.substr(0, file_path.length() - FILE_EXTENSION.length());
 
-    execute_command(false, "./wis " + file_path);
+    execute_command(false, "./wis " + test_flags(file_path) + file_path);
 
     execute_command(false, "./" + file_name + " > " + file_name + ".output");
 }
@@ -8,6 +8,25 @@
 #include <map>
 #include <string>
 #include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <charconv>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <bit>
+
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "./assert.h"
 
@@ -15,7 +34,7 @@ using std::string, std::cout, std::cerr, std::endl;
 
 const string FILE_EXTENSION = "wis";
 
-enum class OpType : int {
+enum class OpType : uint8_t {
     PUSH_INT,
     PUSH_STRING,
     PLUS,
@@ -23,6 +42,7 @@ enum class OpType : int {
     MUL,
     DIV,
     MOD,
+    DIVMOD,
     BOR,
     BAND,
     XOR,
@@ -46,10 +66,32 @@ enum class OpType : int {
     MEM,
     LOAD8,
     STORE8,
+    LOAD16,
+    STORE16,
+    LOAD32,
+    STORE32,
     LOAD64,
     STORE64,
+    LOAD8S,
+    LOAD16S,
+    LOAD32S,
+    ALLOC,
+    FREE,
+    ARENA_ALLOC,
+    ARENA_RESET,
+    MEMCPY,
+    MEMSET,
+    MEMCMP,
+    STRLEN,
+    MEMCHR,
+    STREQ,
     USE,
     PUT,
+    PUTD,
+    PRINT,
+    PRINTD,
+    FMT,
+    FMTD,
     FPUTS,
     HERE,
     COPY,
@@ -65,6 +107,9 @@ enum class OpType : int {
     SYSCALL4,
     SYSCALL5,
     SYSCALL6,
+    CALL,
+    PROC,
+    RET,
     COUNT,
 };
 
@@ -76,6 +121,7 @@ const std::map<OpType, string> HumanizedOpTypes = {
         {OpType::MUL, "`*`"},
         {OpType::DIV, "`/`"},
         {OpType::MOD, "`%`"},
+        {OpType::DIVMOD, "`divmod`"},
         {OpType::BOR, "`binary or`"},
         {OpType::BAND, "`binary and`"},
         {OpType::XOR, "`xor`"},
@@ -99,10 +145,32 @@ const std::map<OpType, string> HumanizedOpTypes = {
         {OpType::MEM, "`mem`"},
         {OpType::LOAD8, "`@8`"},
         {OpType::STORE8, "`!8`"},
+        {OpType::LOAD16, "`@16`"},
+        {OpType::STORE16, "`!16`"},
+        {OpType::LOAD32, "`@32`"},
+        {OpType::STORE32, "`!32`"},
         {OpType::LOAD64, "`@64`"},
         {OpType::STORE64, "`!64`"},
+        {OpType::LOAD8S, "`@8s`"},
+        {OpType::LOAD16S, "`@16s`"},
+        {OpType::LOAD32S, "`@32s`"},
         {OpType::USE, "`use`"},
+        {OpType::ALLOC, "`alloc`"},
+        {OpType::FREE, "`free`"},
+        {OpType::ARENA_ALLOC, "`arena-alloc`"},
+        {OpType::ARENA_RESET, "`arena-reset`"},
+        {OpType::MEMCPY, "`memcpy`"},
+        {OpType::MEMSET, "`memset`"},
+        {OpType::MEMCMP, "`memcmp`"},
+        {OpType::STRLEN, "`strlen`"},
+        {OpType::MEMCHR, "`memchr`"},
+        {OpType::STREQ, "`streq`"},
         {OpType::PUT, "`put`"},
+        {OpType::PUTD, "`putd`"},
+        {OpType::PRINT, "`print`"},
+        {OpType::PRINTD, "`printd`"},
+        {OpType::FMT, "`fmt`"},
+        {OpType::FMTD, "`fmtd`"},
         {OpType::FPUTS, "`fputs`"},
         {OpType::HERE, "`here`"},
         {OpType::COPY, "`copy`"},
@@ -118,14 +186,18 @@ const std::map<OpType, string> HumanizedOpTypes = {
         {OpType::SYSCALL4, "`syscall4`"},
         {OpType::SYSCALL5, "`syscall5`"},
         {OpType::SYSCALL6, "`syscall6`"},
+        {OpType::CALL, "`call`"},
+        {OpType::PROC, "`proc`"},
+        {OpType::RET, "`ret`"},
 };
 
-const std::map<string, OpType> BuiltInOps = {
+const std::map<string, OpType, std::less<>> BuiltInOps = {
         {"+", OpType::PLUS},
         {"-", OpType::MINUS},
         {"*", OpType::MUL},
         {"/", OpType::DIV},
         {"%", OpType::MOD},
+        {"divmod", OpType::DIVMOD},
         {"bor", OpType::BOR},
         {"band", OpType::BAND},
         {"xor", OpType::XOR},
@@ -149,10 +221,32 @@ const std::map<string, OpType> BuiltInOps = {
         {"mem", OpType::MEM},
         {"@8", OpType::LOAD8},
         {"!8", OpType::STORE8},
+        {"@16", OpType::LOAD16},
+        {"!16", OpType::STORE16},
+        {"@32", OpType::LOAD32},
+        {"!32", OpType::STORE32},
         {"@64", OpType::LOAD64},
         {"!64", OpType::STORE64},
+        {"@8s", OpType::LOAD8S},
+        {"@16s", OpType::LOAD16S},
+        {"@32s", OpType::LOAD32S},
         {"use", OpType::USE},
+        {"alloc", OpType::ALLOC},
+        {"free", OpType::FREE},
+        {"arena-alloc", OpType::ARENA_ALLOC},
+        {"arena-reset", OpType::ARENA_RESET},
+        {"memcpy", OpType::MEMCPY},
+        {"memset", OpType::MEMSET},
+        {"memcmp", OpType::MEMCMP},
+        {"strlen", OpType::STRLEN},
+        {"memchr", OpType::MEMCHR},
+        {"streq", OpType::STREQ},
         {"put", OpType::PUT},
+        {"putd", OpType::PUTD},
+        {"print", OpType::PRINT},
+        {"printd", OpType::PRINTD},
+        {"fmt", OpType::FMT},
+        {"fmtd", OpType::FMTD},
         {"fputs", OpType::FPUTS},
         {"here", OpType::HERE},
         {"copy", OpType::COPY},
@@ -170,22 +264,139 @@ const std::map<string, OpType> BuiltInOps = {
         {"syscall6", OpType::SYSCALL6},
 };
 
+// Mapped source file. Tokens keep views into `Data`, so the mapping lives until the compiler exits
+class SourceFile {
+public:
+    string Path;
+    const char* Data = nullptr;
+    size_t Size = 0;
+    bool Mapped = false;
+};
+
+std::vector<SourceFile> source_files;
+std::unordered_map<string, int> source_file_ids;
+
+// Packed source location. Expanded to `path:row:col` only when it's actually printed
+class Location {
+public:
+    uint64_t FileId : 16;
+    uint64_t Row    : 28;
+    uint64_t Col    : 20;
+
+    Location(int file_id, int row, int col)
+            : FileId(file_id), Row(std::min(row, (1 << 28) - 1)), Col(std::min(col, (1 << 20) - 1)) {}
+};
+
+// Compact operation record. Strings and locations are interned in the owning `Program`
 class Operation {
 public:
     OpType Type;
-    int IntegerValue{};
-    string StringValue;
-    string Loc;
+    uint32_t Loc;
     int JumpTo{};
+    union {
+        int IntegerValue;
+        int StringId;
+    };
+
+    Operation(OpType type, uint32_t loc)
+            : Type(type), Loc(loc), IntegerValue(0) {}
+
+    Operation(OpType type, int integer_value, uint32_t loc)
+            : Type(type), Loc(loc), IntegerValue(integer_value) {}
+};
+
+static_assert(sizeof(Operation) == 16, "Operation should stay a 16-byte record");
+
+// Bump allocator for data that lives as long as the program: unescaped string literals and so on
+class Arena {
+public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    char* allocate(size_t size)
+    {
+        if (Blocks.empty() || Used + size > Capacity)
+        {
+            Capacity = std::max(size, BLOCK_SIZE);
+            Blocks.push_back(std::make_unique<char[]>(Capacity));
+            Used = 0;
+        }
+        char* result = Blocks.back().get() + Used;
+        Used += size;
+        return result;
+    }
+
+    std::string_view store(std::string_view s)
+    {
+        char* data = allocate(s.size());
+        if (!s.empty()) memcpy(data, s.data(), s.size());
+        return {data, s.size()};
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> Blocks;
+    size_t Used = 0;
+    size_t Capacity = 0;
+};
+
+// Body of a `bind`. References to other bindings are kept as `call` operations until `inline_bindings`
+class Binding {
+public:
+    std::string_view Name;
+    uint32_t Loc;
+    std::vector<Operation> Body;
+};
+
+// The single program representation every pass after parsing borrows
+// Sizes of the program tables, so a cached module that fails to load halfway can be dropped
+class ProgramMark {
+public:
+    size_t Locations;
+    size_t Strings;
+    size_t Bindings;
+};
 
-    Operation(OpType type, string loc)
-            : Type(type), Loc(std::move(loc)) {}
+class Program {
+public:
+    std::vector<Operation> Ops;
+    std::vector<Location> Locations;
+    std::vector<std::string_view> Strings;
+    std::vector<Binding> Bindings;
+    int CallDepth = 0;
+
+    uint32_t add_location(Location loc)
+    {
+        Locations.push_back(loc);
+        return uint32_t(Locations.size() - 1);
+    }
+
+    ProgramMark mark() const
+    {
+        return {Locations.size(), Strings.size(), Bindings.size()};
+    }
+
+    // Drops locations, strings and bindings added after `mark`
+    void rollback(const ProgramMark& mark)
+    {
+        for (size_t id = mark.Strings; id < Strings.size(); ++id) StringIds.erase(Strings[id]);
+        Locations.erase(Locations.begin() + std::ptrdiff_t(mark.Locations), Locations.end());
+        Strings.resize(mark.Strings);
+        Bindings.erase(Bindings.begin() + std::ptrdiff_t(mark.Bindings), Bindings.end());
+    }
+
+    int intern_string(std::string_view s)
+    {
+        auto it = StringIds.find(s);
+        if (it != StringIds.end()) return it->second;
 
-    Operation(OpType type, int integer_value, string loc)
-            : Type(type), IntegerValue(integer_value), Loc(std::move(loc)) {}
+        std::string_view stored = Storage.store(s);
+        Strings.push_back(stored);
+        StringIds.emplace(stored, int(Strings.size()) - 1);
+        return int(Strings.size()) - 1;
+    }
 
-    Operation(OpType type, string string_value, string loc)
-            : Type(type), StringValue(std::move(string_value)), Loc(std::move(loc)) {}
+private:
+    Arena Storage;
+    std::unordered_map<std::string_view, int> StringIds;
 };
 
 enum class TokenType : int {
@@ -205,15 +416,15 @@ const std::map<TokenType, string> HumanizedTokenTypes = {
 class Token {
 public:
     TokenType Type;
-    string StringValue;
+    std::string_view StringValue;
     int IntegerValue{};
-    string Loc;
+    Location Loc;
 
-    Token(TokenType type, int integer_value, string  loc)
-            : Type(type), IntegerValue(integer_value), Loc(std::move(loc)) {}
+    Token(TokenType type, std::string_view string_value, int integer_value, Location loc)
+            : Type(type), StringValue(string_value), IntegerValue(integer_value), Loc(loc) {}
 
-    Token(TokenType type, string  string_value, string  loc)
-            : Type(type), StringValue(std::move(string_value)), Loc(std::move(loc)) {}
+    Token(TokenType type, std::string_view string_value, Location loc)
+            : Type(type), StringValue(string_value), Loc(loc) {}
 };
 
 enum class DataType : int {
@@ -232,20 +443,42 @@ const std::map<DataType, string> HumanizedDataTypes = {
 class Type {
 public:
     DataType Code;
-    string Loc;
+    uint32_t Loc;
 
-    Type(DataType code, string loc)
-            : Code(code), Loc(std::move(loc)) {}
+    Type(DataType code, uint32_t loc)
+            : Code(code), Loc(loc) {}
 };
 
 void usage(string const& compiler_path)
 {
-    cerr << "Usage: " << compiler_path << " [OPTIONS] <path>" << endl;
+    cerr << "Usage: " << compiler_path << " [OPTIONS] <path>..." << endl;
+    cerr << "    Each <path> is a file or a directory of files, several of them are compiled in parallel" << endl;
     cerr << "OPTIONS:" << endl;
     cerr << "    -unsafe       Disable type checking" << endl;
     cerr << "    -r            Run compiled program after compilation" << endl;
     cerr << "    -quiet        Disable any compiler's logs" << endl;
+    cerr << "    -O            Optimize generated assembly" << endl;
+    cerr << "    -nasm         Write assembly and build the executable with NASM and ld" << endl;
+    cerr << "    -jit          Run the program in memory without writing any files" << endl;
+    cerr << "    -interpret    Run the program with the bytecode interpreter" << endl;
+    cerr << "    -buffering <full|line|none>" << endl;
+    cerr << "                  Output buffering of `put` and `fputs` (default: full)" << endl;
     cerr << "    -I <path>     Add directory to include paths list" << endl;
+    cerr << "    -cache <path> Directory for precompiled used files (default: $WIS_CACHE_DIR, $XDG_CACHE_HOME/wis or ~/.cache/wis)" << endl;
+    cerr << "    -no-cache     Always parse used files from source, as does an empty $WIS_CACHE_DIR" << endl;
+    cerr << "    -inline-threshold <n>" << endl;
+    cerr << "                  Compile bindings longer than <n> operations that are used more than once" << endl;
+    cerr << "                  as procedures instead of expanding them in place" << endl;
+    cerr << "    -j <n>        Compile up to <n> programs at once (default: number of processors)" << endl;
+}
+
+// `WIS_CACHE_DIR` overrides the default, and an empty one disables the cache
+string default_cache_directory()
+{
+    if (const char* cache_dir = getenv("WIS_CACHE_DIR"); cache_dir != nullptr) return cache_dir;
+    if (const char* xdg_cache = getenv("XDG_CACHE_HOME"); xdg_cache != nullptr && *xdg_cache != '\0') return string(xdg_cache) + "/wis";
+    if (const char* home = getenv("HOME"); home != nullptr && *home != '\0') return string(home) + "/.cache/wis";
+    return "";
 }
 
 string get_file_extension(const string &filename) {
@@ -259,9 +492,14 @@ void compilation_error(const string& message)
     cerr << "ERROR: " << message << endl;
 }
 
-void compilation_error(const string& loc, const string& message)
+string location_view(const Location& loc)
+{
+    return source_files[loc.FileId].Path + ":" + std::to_string(loc.Row) + ":" + std::to_string(loc.Col);
+}
+
+void compilation_error(const Location& loc, const string& message)
 {
-    cerr << loc << ": ERROR: " << message << endl;
+    cerr << location_view(loc) << ": ERROR: " << message << endl;
 }
 
 string shift_vector(std::vector<string>& vec)
@@ -278,22 +516,6 @@ string shift_vector(std::vector<string>& vec)
     exit(1);
 }
 
-std::vector<string> split_string(const string& input, const string& delimiter) {
-    std::vector<string> result;
-    size_t start = 0;
-    size_t end = input.find(delimiter);
-
-    while (end != string::npos) {
-        result.push_back(input.substr(start, end - start));
-        start = end + delimiter.length();
-        end = input.find(delimiter, start);
-    }
-
-    result.push_back(input.substr(start));
-
-    return result;
-}
-
 string trim_string(string s, const string& substring) {
     size_t pos = s.find(substring);
     if (pos != string::npos) {
@@ -346,23 +568,13 @@ string unescape_string(const string& s) {
     return ss.str();
 }
 
-void complete_string(string& s, const string& additional)
-{
-    s += additional + "\n";
-}
-
-bool string_to_int(const std::string& str, int& result) {
-    std::istringstream iss(str);
-
-    if (!(iss >> result)) return false;
-    if (iss.rdbuf()->in_avail() != 0) return false;
+bool string_to_int(std::string_view str, int& result) {
+    if (str.size() > 1 && str[0] == '+') str.remove_prefix(1);
 
-    return true;
-}
+    const char* end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, result);
 
-string location_view(const string& filepath, int row, int col)
-{
-    return filepath + ":" + std::to_string(row) + ":" + std::to_string(col);
+    return ec == std::errc() && ptr == end;
 }
 
 void execute_command(bool silent_mode, const string& command)
@@ -376,147 +588,280 @@ void execute_command(bool silent_mode, const string& command)
     }
 }
 
-void extend_with_include_directories(string& file_path, const std::vector<string>& include_paths)
+// Basename -> path index over include directories, built on the first lookup and shared by every `use`.
+// Lookup order: include directories in the order they were added (`./std/`, `./use/`, then `-I` paths
+// as passed), first directory containing the name wins. Names not found there are used as written
+class IncludeIndex {
+public:
+    explicit IncludeIndex(std::vector<string> include_paths)
+            : IncludePaths(std::move(include_paths)) {}
+
+    string resolve(const string& file_path)
+    {
+        if (!Built) build();
+
+        auto it = Files.find(file_path);
+        if (it != Files.end()) return it->second;
+        return file_path;
+    }
+
+private:
+    std::vector<string> IncludePaths;
+    std::unordered_map<string, string> Files;
+    bool Built = false;
+
+    void build()
+    {
+        Built = true;
+
+        for (const auto& include_path : IncludePaths)
+        {
+            std::error_code ec;
+            for (std::filesystem::directory_iterator it(include_path, ec), end; !ec && it != end; it.increment(ec)) {
+                if (it->is_directory(ec)) continue;
+                Files.emplace(it->path().filename().string(), it->path().string());
+            }
+        }
+    }
+};
+
+// Maps the whole file read-only. The mapping is never released, views into it stay valid until exit
+bool map_file(const string& path, const char*& data, size_t& size)
 {
-    for (const auto& include_path : include_paths)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
     {
-        if (!std::filesystem::exists(include_path)) continue;
-        for (const auto& entry : std::filesystem::directory_iterator(include_path)) {
-            std::vector<string> parts = split_string(entry.path().string(), "/");
-            if (parts.empty()) continue;
-            string file_name = parts[parts.size() - 1];
+        close(fd);
+        return false;
+    }
 
-            if (file_path == file_name) file_path = entry.path().string();
+    data = nullptr;
+    size = size_t(st.st_size);
+
+    if (size > 0)
+    {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            return false;
         }
+        data = static_cast<const char*>(mapping);
+    }
+    close(fd);
+
+    return true;
+}
+
+// Registers a path for locations without reading the file, e.g. for locations loaded from the module cache
+int register_source_file(const string& path)
+{
+    auto it = source_file_ids.find(path);
+    if (it != source_file_ids.end()) return it->second;
+
+    SourceFile file;
+    file.Path = path;
+    source_files.push_back(std::move(file));
+
+    int id = int(source_files.size()) - 1;
+    source_file_ids.emplace(path, id);
+    return id;
+}
+
+int map_source_file(const string& path)
+{
+    int id = register_source_file(path);
+    SourceFile& file = source_files[id];
+
+    if (!file.Mapped)
+    {
+        if (!map_file(path, file.Data, file.Size)) return -1;
+        file.Mapped = true;
     }
+
+    return id;
+}
+
+inline bool is_whitespace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
 
-std::vector<Token> lex_line(string const& filepath, int line_number, string line)
+std::vector<Token> lex_file(string const& path)
 {
-    line += " ";
+    int file_id = map_source_file(path);
+
+    if (file_id < 0)
+    {
+        compilation_error("File `" + path + "` not found in include directories");
+        exit(1);
+    }
+
+    const char* data = source_files[file_id].Data;
+    size_t size = source_files[file_id].Size;
+
     std::vector<Token> tokens;
+    // Sources of the standard library, tests and examples average about 8 bytes per token
+    tokens.reserve(size / 8);
 
-    string cur;
-    int i = 0;
-    bool string_mode = false;
-    bool char_mode = false;
+    int row = 1;
+    size_t line_start = 0;
+    size_t i = 0;
 
-    while (i < int(line.size()))
+    while (i < size)
     {
-        char ch = line[i];
-        if (ch == '"' && !char_mode)
+        char ch = data[i];
+
+        if (ch == '\n')
         {
-            if (string_mode)
-            {
-                string loc = location_view(filepath, line_number, i - int(cur.size()));
-                tokens.emplace_back(TokenType::STRING, cur, loc);
-                cur = "";
-            }
-            string_mode = !string_mode;
+            ++row;
+            line_start = ++i;
+            continue;
         }
-        else if (ch == '\'' && !string_mode)
+
+        if (is_whitespace(ch))
         {
-            if (char_mode)
-            {
-                string loc = location_view(filepath, line_number, i - int(cur.size()));
-                if (unescape_string(cur).size() != 1)
-                {
-                    compilation_error(loc, "`char` should be exactly 1 character");
-                    exit(1);
-                }
-                tokens.emplace_back(TokenType::CHAR, cur, loc);
-                cur = "";
-            }
-            char_mode = !char_mode;
+            ++i;
+            continue;
+        }
+
+        if (ch == '/' && i + 1 < size && data[i + 1] == '/')
+        {
+            while (i < size && data[i] != '\n') ++i;
+            continue;
         }
-        else if (ch == ' ' && (!cur.empty() || string_mode || char_mode))
+
+        Location loc(file_id, row, int(i - line_start) + 1);
+
+        if (ch == '"' || ch == '\'')
         {
-            if (string_mode || char_mode)
+            size_t start = ++i;
+            while (i < size && data[i] != ch && data[i] != '\n')
+            {
+                if (data[i] == '\\' && i + 1 < size && data[i + 1] != '\n') ++i;
+                ++i;
+            }
+
+            if (i == size || data[i] != ch)
+            {
+                compilation_error(loc, ch == '"' ? "Unterminated `string` literal" : "Unterminated `char` literal");
+                exit(1);
+            }
+
+            std::string_view value(data + start, i - start);
+            ++i;
+
+            if (ch == '"')
             {
-                cur += ch;
+                tokens.emplace_back(TokenType::STRING, value, loc);
             }
             else
             {
-                int int_value;
-                if (string_to_int(cur, int_value))
-                {
-                    string loc = location_view(filepath, line_number, i);
-                    tokens.emplace_back(TokenType::INT, int_value, loc);
-                }
-                else
+                if (unescape_string(string(value)).size() != 1)
                 {
-                    string loc = location_view(filepath, line_number, i - int(cur.size()) + 1);
-                    tokens.emplace_back(TokenType::WORD, cur, loc);
+                    compilation_error(loc, "`char` should be exactly 1 character");
+                    exit(1);
                 }
-                cur = "";
+                tokens.emplace_back(TokenType::CHAR, value, loc);
             }
+            continue;
         }
-        else if (ch != ' ')
-        {
-            cur += ch;
-        }
 
-        ++i;
+        size_t start = i;
+        while (i < size && !is_whitespace(data[i]) && !(data[i] == '/' && i + 1 < size && data[i + 1] == '/')) ++i;
+
+        std::string_view word(data + start, i - start);
+
+        int int_value;
+        if (string_to_int(word, int_value)) tokens.emplace_back(TokenType::INT, word, int_value, loc);
+        else tokens.emplace_back(TokenType::WORD, word, loc);
     }
 
     return tokens;
 }
 
-std::vector<Token> lex_file(string const& path)
-{
-    std::fstream file(path);
+enum class ModuleState : int {
+    PARSING,
+    PARSED,
+    COUNT,
+};
 
-    if (!file.is_open())
-    {
-        compilation_error("File `" + path + "` not found in include directories");
-        exit(1);
-    }
+// A single `.wis` file. `Bindings` lists ids of its own bindings in definition order; `Scope` maps every
+// visible name, including ones brought in with `use`, to the id of its binding in `Program::Bindings`
+class Module {
+public:
+    string Path;
+    ModuleState State = ModuleState::PARSING;
+    uint64_t SourceHash = 0;
+    uint64_t Key = 0;
+    std::vector<const Module*> Dependencies;
+    std::vector<Operation> Ops;
+    std::vector<int> Bindings;
+    std::unordered_map<std::string_view, int> Scope;
+};
 
-    std::vector<Token> tokens;
+// Every file is lexed and parsed once. `Order` lists modules dependencies-first
+class ModuleGraph {
+public:
+    explicit ModuleGraph(const std::vector<string>& include_paths)
+            : Includes(include_paths) {}
+
+    IncludeIndex Includes;
+    std::unordered_map<string, std::unique_ptr<Module>> Modules;
+    std::vector<Module*> Order;
+    string CacheDirectory;
+    uint64_t IncludeHash = 0;
+};
 
-    string line;
-    int line_number = 1;
-    while (getline(file, line))
-    {
-        line = split_string(line, "//")[0];
-        std::vector<Token> line_tokens = lex_line(path, line_number, line);
+Module& load_module(ModuleGraph& graph, Program& program, const string& path, const Token* use_token);
 
-        for (const auto & line_token : line_tokens) {
-            tokens.push_back(line_token);
+void import_module_scope(Module& module, const Module& dependency, const Token& use_token)
+{
+    for (const auto& [name, binding_id] : dependency.Scope)
+    {
+        auto [it, inserted] = module.Scope.emplace(name, binding_id);
+        if (!inserted && it->second != binding_id)
+        {
+            compilation_error(use_token.Loc, "Binding `" + string(name) + "` from `" + dependency.Path + "` conflicts with already defined binding");
+            exit(1);
         }
-        line_number++;
     }
-
-    file.close();
-
-    return tokens;
 }
 
-std::vector<Operation> parse_tokens_as_operations(std::vector<Token>& tokens, const std::vector<string>& include_paths)
+// `here` is resolved to its location string right away, so later passes see it as a plain string push
+Operation make_builtin_operation(Program& program, OpType type, Location loc)
 {
-    std::vector<Operation> program;
-    std::map<string, std::vector<Operation>> bindings;
+    Operation op(type, program.add_location(loc));
+    if (type == OpType::HERE) op.StringId = program.intern_string(location_view(loc));
+    return op;
+}
 
+void parse_tokens_as_operations(ModuleGraph& graph, Program& program, Module& module, const std::vector<Token>& tokens)
+{
     assert(static_cast<int>(TokenType::COUNT) == 4, "Exhaustive token types handling");
 
     for (int i = 0; i < int(tokens.size()); ++i) {
-        Token token = tokens[i];
+        const Token& token = tokens[i];
 
-        assert(static_cast<int>(OpType::COUNT) == 49, "Exhaustive operations handling");
+        assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling");
 
         switch (token.Type) {
             case TokenType::INT:
-                program.emplace_back(OpType::PUSH_INT, token.IntegerValue, token.Loc);
+                module.Ops.emplace_back(OpType::PUSH_INT, token.IntegerValue, program.add_location(token.Loc));
                 break;
             case TokenType::STRING:
             {
-                program.emplace_back(OpType::PUSH_STRING, unescape_string(token.StringValue), token.Loc);
+                int string_id = program.intern_string(unescape_string(string(token.StringValue)));
+                module.Ops.emplace_back(OpType::PUSH_STRING, string_id, program.add_location(token.Loc));
                 break;
             }
             case TokenType::CHAR:
             {
-                int value = (int)unescape_string(token.StringValue)[0];
-                program.emplace_back(OpType::PUSH_INT, value, token.Loc);
+                int value = (int)unescape_string(string(token.StringValue))[0];
+                module.Ops.emplace_back(OpType::PUSH_INT, value, program.add_location(token.Loc));
                 break;
             }
             case TokenType::WORD:
@@ -528,80 +873,89 @@ std::vector<Operation> parse_tokens_as_operations(std::vector<Token>& tokens, co
                         exit(1);
                     }
 
-                    token = tokens[i];
+                    const Token& name_token = tokens[i];
 
-                    if (token.Type != TokenType::WORD)
+                    if (name_token.Type != TokenType::WORD)
                     {
-                        compilation_error(token.Loc, "Invalid token's type for binding's name. Expected token type `word`, but found " + HumanizedTokenTypes.at(token.Type));
+                        compilation_error(name_token.Loc, "Invalid token's type for binding's name. Expected token type `word`, but found " + HumanizedTokenTypes.at(name_token.Type));
                         exit(1);
                     }
 
-                    string name = token.StringValue;
+                    std::string_view name = name_token.StringValue;
                     auto it = BuiltInOps.find(name);
 
                     if (it != BuiltInOps.end())
                     {
-                        compilation_error(token.Loc, "Binding name can't conflict with built in operations. Use other name, instead of `" + name + "`");
+                        compilation_error(name_token.Loc, "Binding name can't conflict with built in operations. Use other name, instead of `" + string(name) + "`");
+                        exit(1);
+                    }
+
+                    if (module.Scope.contains(name))
+                    {
+                        compilation_error(name_token.Loc, "Binding `" + string(name) + "` is already defined");
                         exit(1);
                     }
 
+                    int binding_id = int(program.Bindings.size());
+                    program.Bindings.push_back({name, program.add_location(name_token.Loc), {}});
+                    std::vector<Operation>& body = program.Bindings[binding_id].Body;
                     int open_blocks = 0;
 
                     while (++i < int(tokens.size()) && (tokens[i].StringValue != "end" || open_blocks != 0))
                     {
-                        token = tokens[i];
+                        const Token& body_token = tokens[i];
 
-                        if (token.StringValue == name)
+                        if (body_token.StringValue == name)
                         {
-                            compilation_error(token.Loc, "Bindings are not support recursive calls");
+                            compilation_error(body_token.Loc, "Bindings are not support recursive calls");
                             exit(1);
                         }
 
-                        if (token.StringValue == "if" || token.StringValue == "while") open_blocks++;
+                        if (body_token.StringValue == "if" || body_token.StringValue == "while") open_blocks++;
 
-                        if (token.StringValue != "end" || open_blocks > 0)
+                        if (body_token.StringValue != "end" || open_blocks > 0)
                         {
-                            switch (token.Type)
+                            switch (body_token.Type)
                             {
                                 case TokenType::STRING:
                                 {
-
-                                    bindings[name].emplace_back(OpType::PUSH_STRING, unescape_string(token.StringValue), token.Loc);
+                                    int string_id = program.intern_string(unescape_string(string(body_token.StringValue)));
+                                    body.emplace_back(OpType::PUSH_STRING, string_id, program.add_location(body_token.Loc));
                                     break;
                                 }
                                 case TokenType::INT:
                                 {
-                                    bindings[name].emplace_back(OpType::PUSH_INT, token.IntegerValue, token.Loc);
+                                    body.emplace_back(OpType::PUSH_INT, body_token.IntegerValue, program.add_location(body_token.Loc));
                                     break;
                                 }
                                 default:
                                 {
-                                    auto iter = BuiltInOps.find(token.StringValue);
+                                    auto iter = BuiltInOps.find(body_token.StringValue);
 
                                     if (iter != BuiltInOps.end())
                                     {
-                                        bindings[name].emplace_back(BuiltInOps.at(token.StringValue), token.Loc);
+                                        body.push_back(make_builtin_operation(program, iter->second, body_token.Loc));
                                         break;
                                     }
 
-                                    auto itt = bindings.find(token.StringValue);
-                                    if (itt != bindings.end())
+                                    auto itt = module.Scope.find(body_token.StringValue);
+                                    if (itt != module.Scope.end())
                                     {
-                                        std::vector<Operation> binding = bindings[token.StringValue];
-                                        for (const auto & op : binding) {
-                                            bindings[name].push_back(op);
-                                        }
+                                        body.emplace_back(OpType::CALL, itt->second, program.add_location(body_token.Loc));
                                         break;
                                     }
 
-                                    compilation_error(token.Loc, "Undefined token: `" + token.StringValue + "`");
+                                    compilation_error(body_token.Loc, "Undefined token: `" + string(body_token.StringValue) + "`");
                                     exit(1);
                                 }
                             }
                         }
 
-                        if (open_blocks > 0 && token.StringValue == "end") open_blocks--;
+                        if (open_blocks > 0 && body_token.StringValue == "end") open_blocks--;
                     }
+
+                    module.Bindings.push_back(binding_id);
+                    module.Scope.emplace(name, binding_id);
                 }
                 else if (token.StringValue == "use")
                 {
@@ -611,52 +965,40 @@ std::vector<Operation> parse_tokens_as_operations(std::vector<Token>& tokens, co
                         exit(1);
                     }
 
-                    token = tokens[i];
+                    const Token& path_token = tokens[i];
 
-                    if (token.Type != TokenType::STRING)
+                    if (path_token.Type != TokenType::STRING)
                     {
-                        compilation_error(token.Loc, "Expected type `string` after `use` keyword, bot found " + HumanizedTokenTypes.at(token.Type));
+                        compilation_error(path_token.Loc, "Expected type `string` after `use` keyword, bot found " + HumanizedTokenTypes.at(path_token.Type));
                         exit(1);
                     }
 
-                    string file_path = token.StringValue;
-
-                    extend_with_include_directories(file_path, include_paths);
-
-                    std::vector<Token> using_tokens = lex_file(file_path);
-
-                    std::vector<Token> temp_tokens = tokens;
+                    string file_path = graph.Includes.resolve(string(path_token.StringValue));
 
-                    tokens = using_tokens;
+                    const Module& dependency = load_module(graph, program, file_path, &path_token);
 
-                    for (size_t j = 0; j < temp_tokens.size(); ++j)
-                    {
-                        Token tt = temp_tokens[j];
-                        if ((tt.Type != TokenType::STRING && tt.StringValue == "use") || (j > 0 && temp_tokens[j-1].Type != TokenType::STRING && temp_tokens[j-1].StringValue == "use")) continue;
-                        tokens.push_back(tt);
-                    }
-                    i = -1;
-                    program = std::vector<Operation>();
+                    module.Dependencies.push_back(&dependency);
+                    import_module_scope(module, dependency, path_token);
                 }
                 else
                 {
-                    try
+                    auto builtin = BuiltInOps.find(token.StringValue);
+
+                    if (builtin != BuiltInOps.end())
                     {
-                        program.emplace_back(BuiltInOps.at(token.StringValue), token.Loc);
+                        module.Ops.push_back(make_builtin_operation(program, builtin->second, token.Loc));
                     }
-                    catch(...)
+                    else
                     {
-                        auto it = bindings.find(token.StringValue);
+                        auto it = module.Scope.find(token.StringValue);
 
-                        if (it != bindings.end())
+                        if (it != module.Scope.end())
                         {
-                            for (const auto& binding : bindings.at(token.StringValue)) {
-                                program.push_back(binding);
-                            }
+                            module.Ops.emplace_back(OpType::CALL, it->second, program.add_location(token.Loc));
                         }
                         else
                         {
-                            compilation_error(token.Loc, "Undefined token: `" + token.StringValue + "`");
+                            compilation_error(token.Loc, "Undefined token: `" + string(token.StringValue) + "`");
                             exit(1);
                         }
                     }
@@ -666,103 +1008,670 @@ std::vector<Operation> parse_tokens_as_operations(std::vector<Token>& tokens, co
                 assert(false, "Unreachable");
         }
     }
-
-    return program;
 }
 
-void crossreference_blocks(std::vector<Operation>& program)
-{
-    std::stack<int> crossreference_stack;
+// Precompiled modules cache.
+// A used file is stored with its own bindings and top-level operations, the list of files it uses and
+// a key: hash of its content, include paths and keys of its dependencies. Bindings of dependencies are
+// not stored, they are loaded through their own cache entries, so `use` keeps include-once semantics.
+// `call` operations refer to their binding by name and are resolved against the module's scope on load.
+const char MODULE_CACHE_MAGIC[8] = {'W', 'I', 'S', 'M', 'O', 'D', 0, 10};
 
-    assert(static_cast<int>(OpType::COUNT) == 49, "Exhaustive operations handling. Not all operations should be handled in here");
+class CachedModuleHeader {
+public:
+    char Magic[8];
+    uint32_t OpTypeCount;
+    uint32_t OperationSize;
+    uint64_t SourceHash;
+    uint64_t IncludeHash;
+    uint64_t Key;
+    // Hash of everything after the header, so a damaged entry isn't mistaken for a valid one
+    uint64_t ContentHash;
+    uint32_t DependencyCount;
+    uint32_t PathCount;
+    uint32_t StringCount;
+    uint32_t LiteralCount;
+    uint32_t LocationCount;
+    uint32_t OpCount;
+    uint32_t TopLevelOpCount;
+    uint32_t BindingCount;
+    uint32_t BlobSize;
+};
 
-    for (int i = 0; i < int(program.size()); ++i) {
-        Operation op = program[i];
+class CachedDependency {
+public:
+    uint32_t Path;
+    uint32_t Padding;
+    uint64_t Key;
+};
 
-        switch (op.Type) {
-            case OpType::IF:
-            case OpType::WHILE:
-            {
-                crossreference_stack.push(i);
-                break;
-            }
-            case OpType::ELSE:
-            {
-                if (crossreference_stack.empty())
-                {
-                    compilation_error(op.Loc, "`else` operation can only be used in `if` block");
-                    exit(1);
-                }
-                int pos = crossreference_stack.top();
-                crossreference_stack.pop();
-                program[pos].JumpTo = i + 1;
-                crossreference_stack.push(i);
-                break;
-            }
-            case OpType::DO:
-            {
-                if (crossreference_stack.empty())
-                {
-                    compilation_error(op.Loc, "`do` operation can only be used in `while` block");
-                    exit(1);
-                }
-                int top = crossreference_stack.top();
-                program[i].JumpTo = top;
-                crossreference_stack.pop();
-                crossreference_stack.push(i);
-                break;
-            }
-            case OpType::END:
-            {
-                if (crossreference_stack.empty())
-                {
-                    compilation_error(op.Loc, "`end` operation can only be used to close other blocks");
-                    exit(1);
-                }
-                int pos = crossreference_stack.top();
-                crossreference_stack.pop();
+class CachedSpan {
+public:
+    uint32_t Offset;
+    uint32_t Size;
+};
 
-                switch (program[pos].Type) {
-                    case OpType::IF:
-                    case OpType::ELSE:
-                    {
-                        program[pos].JumpTo = i;
-                        break;
-                    }
-                    case OpType::DO:
-                    {
-                        program[i].JumpTo = program[pos].JumpTo;
-                        program[pos].JumpTo = i + 1;
-                        break;
-                    }
-                    default:
-                    {
-                        compilation_error(op.Loc, "Only `if` and `while` blocks can be closed with `end` keyword");
-                        exit(1);
-                    }
-                }
-            }
-        }
-    }
+class CachedLocation {
+public:
+    uint32_t Path;
+    uint32_t Row;
+    uint32_t Col;
+};
 
-    if (!crossreference_stack.empty())
-    {
-        int latest_pos = crossreference_stack.top();
-        crossreference_stack.pop();
+class CachedBinding {
+public:
+    uint32_t Name;
+    uint32_t Loc;
+    uint32_t FirstOp;
+    uint32_t OpCount;
+};
 
-        compilation_error(program[latest_pos].Loc, "Not all blocks was closed with `end` keyword");
-        exit(1);
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
 }
 
-void type_check_program(const std::vector<Operation>& program)
+uint64_t hash_combine(uint64_t hash, uint64_t value)
 {
-    assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
+    return hash_bytes(&value, sizeof(value), hash);
+}
 
-    std::stack<Type> type_checking_stack;
+uint64_t hash_include_paths(const std::vector<string>& include_paths)
+{
+    uint64_t hash = hash_bytes(nullptr, 0);
+    for (const auto& include_path : include_paths) {
+        hash = hash_bytes(include_path.data(), include_path.size() + 1, hash);
+    }
+    return hash;
+}
+
+uint64_t module_key(const Module& module, uint64_t include_hash)
+{
+    uint64_t key = hash_combine(module.SourceHash, include_hash);
+    for (const Module* dependency : module.Dependencies) key = hash_combine(key, dependency->Key);
+    return key;
+}
+
+string module_cache_path(const string& cache_directory, const string& module_key_path)
+{
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << hash_bytes(module_key_path.data(), module_key_path.size()) << ".wism";
+    return (std::filesystem::path(cache_directory) / name.str()).string();
+}
+
+// Returns false if there is no valid cache entry, the module should be parsed from source then
+bool load_cached_module(ModuleGraph& graph, Program& program, Module& module, const string& cache_path, const Token* use_token)
+{
+    const char* data;
+    size_t size;
+
+    if (!map_file(cache_path, data, size) || size < sizeof(CachedModuleHeader)) return false;
+
+    CachedModuleHeader header{};
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.Magic, MODULE_CACHE_MAGIC, sizeof(MODULE_CACHE_MAGIC)) != 0 ||
+        header.OpTypeCount != static_cast<uint32_t>(OpType::COUNT) || header.OperationSize != sizeof(Operation) ||
+        header.SourceHash != module.SourceHash || header.IncludeHash != graph.IncludeHash) return false;
+
+    size_t dependencies_offset = sizeof(CachedModuleHeader);
+    size_t paths_offset = dependencies_offset + size_t(header.DependencyCount) * sizeof(CachedDependency);
+    size_t strings_offset = paths_offset + size_t(header.PathCount) * sizeof(CachedSpan);
+    size_t locations_offset = strings_offset + size_t(header.StringCount) * sizeof(CachedSpan);
+    size_t ops_offset = locations_offset + size_t(header.LocationCount) * sizeof(CachedLocation);
+    size_t bindings_offset = ops_offset + size_t(header.OpCount) * sizeof(Operation);
+    size_t blob_offset = bindings_offset + size_t(header.BindingCount) * sizeof(CachedBinding);
+
+    if (blob_offset + header.BlobSize != size || header.TopLevelOpCount > header.OpCount) return false;
+    if (hash_bytes(data + sizeof(header), size - sizeof(header)) != header.ContentHash) return false;
+
+    auto span_view = [&](size_t table_offset, uint32_t index) -> std::string_view {
+        CachedSpan span{};
+        memcpy(&span, data + table_offset + size_t(index) * sizeof(CachedSpan), sizeof(span));
+        if (size_t(span.Offset) + span.Size > header.BlobSize) return {};
+        return {data + blob_offset + span.Offset, span.Size};
+    };
+
+    for (uint32_t i = 0; i < header.DependencyCount; ++i) {
+        CachedDependency cached{};
+        memcpy(&cached, data + dependencies_offset + size_t(i) * sizeof(CachedDependency), sizeof(cached));
+        if (cached.Path >= header.PathCount) return false;
+
+        const Module& dependency = load_module(graph, program, string(span_view(paths_offset, cached.Path)), use_token);
+        module.Dependencies.push_back(&dependency);
+        if (dependency.Key != cached.Key) return false;
+    }
+
+    // Dependencies stay loaded, everything added after them is dropped if the file turns out broken
+    ProgramMark mark = program.mark();
+    auto rollback = [&]() {
+        program.rollback(mark);
+        return false;
+    };
+
+    if (module_key(module, graph.IncludeHash) != header.Key) return rollback();
+
+    std::vector<int> file_ids(header.PathCount);
+    for (uint32_t i = 0; i < header.PathCount; ++i) file_ids[i] = register_source_file(string(span_view(paths_offset, i)));
+
+    // String literals go first in the strings table, followed by binding names, which aren't interned
+    if (header.LiteralCount > header.StringCount) return rollback();
+
+    std::vector<int> string_ids(header.LiteralCount);
+    for (uint32_t i = 0; i < header.LiteralCount; ++i) string_ids[i] = program.intern_string(span_view(strings_offset, i));
+
+    std::vector<uint32_t> location_ids(header.LocationCount);
+    for (uint32_t i = 0; i < header.LocationCount; ++i) {
+        CachedLocation cached{};
+        memcpy(&cached, data + locations_offset + size_t(i) * sizeof(CachedLocation), sizeof(cached));
+        if (cached.Path >= header.PathCount) return rollback();
+        location_ids[i] = program.add_location(Location(file_ids[cached.Path], int(cached.Row), int(cached.Col)));
+    }
+
+    std::vector<Operation> ops;
+    ops.reserve(header.OpCount);
+    for (uint32_t i = 0; i < header.OpCount; ++i) {
+        Operation op(OpType::COUNT, 0);
+        memcpy(&op, data + ops_offset + size_t(i) * sizeof(Operation), sizeof(op));
+
+        if (static_cast<int>(op.Type) >= static_cast<int>(OpType::COUNT) || op.Loc >= header.LocationCount) return rollback();
+        op.Loc = location_ids[op.Loc];
+
+        if (op.Type == OpType::PUSH_STRING || op.Type == OpType::HERE)
+        {
+            if (op.StringId < 0 || uint32_t(op.StringId) >= header.LiteralCount) return rollback();
+            op.StringId = string_ids[op.StringId];
+        }
+        ops.push_back(op);
+    }
+
+    for (const Module* dependency : module.Dependencies) import_module_scope(module, *dependency, *use_token);
+
+    std::vector<CachedBinding> bindings(header.BindingCount);
+    for (uint32_t i = 0; i < header.BindingCount; ++i) {
+        memcpy(&bindings[i], data + bindings_offset + size_t(i) * sizeof(CachedBinding), sizeof(CachedBinding));
+        if (bindings[i].Name >= header.StringCount || bindings[i].Loc >= header.LocationCount ||
+            size_t(bindings[i].FirstOp) + bindings[i].OpCount > header.OpCount) return rollback();
+
+        std::string_view name = span_view(strings_offset, bindings[i].Name);
+        if (module.Scope.contains(name)) return rollback();
+
+        int binding_id = int(program.Bindings.size());
+        program.Bindings.push_back({name, location_ids[bindings[i].Loc], {}});
+        module.Bindings.push_back(binding_id);
+        module.Scope.emplace(name, binding_id);
+    }
+
+    for (auto& op : ops) {
+        if (op.Type != OpType::CALL) continue;
+        if (op.IntegerValue < 0 || uint32_t(op.IntegerValue) >= header.StringCount) return rollback();
+
+        auto it = module.Scope.find(span_view(strings_offset, uint32_t(op.IntegerValue)));
+        if (it == module.Scope.end()) return rollback();
+        op.IntegerValue = it->second;
+    }
+
+    module.Ops.assign(ops.begin(), ops.begin() + header.TopLevelOpCount);
+
+    for (uint32_t i = 0; i < header.BindingCount; ++i) {
+        std::vector<Operation>& body = program.Bindings[module.Bindings[i]].Body;
+        body.assign(ops.begin() + bindings[i].FirstOp, ops.begin() + bindings[i].FirstOp + bindings[i].OpCount);
+    }
+
+    module.Key = header.Key;
+    return true;
+}
+
+template<typename T>
+void append_record(string& out, const T& record)
+{
+    out.append(reinterpret_cast<const char*>(&record), sizeof(T));
+}
+
+// Cache is an optimization only, so any failure to store it is ignored
+void store_cached_module(const Program& program, const Module& module, const string& cache_path, uint64_t include_hash)
+{
+    std::unordered_map<int, uint32_t> path_indices;
+    std::unordered_map<string, uint32_t> path_by_name;
+    string blob;
+
+    auto add_span = [&](std::vector<CachedSpan>& table, std::string_view s) {
+        table.push_back({uint32_t(blob.size()), uint32_t(s.size())});
+        blob.append(s);
+        return uint32_t(table.size() - 1);
+    };
+
+    std::vector<CachedSpan> path_spans;
+    auto add_path = [&](const string& path) {
+        auto it = path_by_name.find(path);
+        if (it != path_by_name.end()) return it->second;
+        uint32_t index = add_span(path_spans, path);
+        path_by_name.emplace(path, index);
+        return index;
+    };
+
+    std::vector<CachedDependency> dependencies;
+    for (const Module* dependency : module.Dependencies) {
+        dependencies.push_back({add_path(dependency->Path), 0, dependency->Key});
+    }
+
+    std::vector<CachedSpan> string_spans;
+    std::unordered_map<int, uint32_t> string_indices;
+    std::vector<CachedLocation> locations;
+    std::unordered_map<uint32_t, uint32_t> location_indices;
+    std::vector<Operation> ops;
+    std::vector<CachedBinding> bindings;
+
+    // Literals are stored in the order they were interned, so loading them back keeps string ids stable
+    std::vector<int> literals;
+    auto collect_literals = [&](const std::vector<Operation>& source) {
+        for (const auto& op : source) {
+            if (op.Type == OpType::PUSH_STRING || op.Type == OpType::HERE) literals.push_back(op.StringId);
+        }
+    };
+    collect_literals(module.Ops);
+    for (int binding_id : module.Bindings) collect_literals(program.Bindings[binding_id].Body);
+
+    std::sort(literals.begin(), literals.end());
+    literals.erase(std::unique(literals.begin(), literals.end()), literals.end());
+    for (int string_id : literals) string_indices.emplace(string_id, add_span(string_spans, program.Strings[string_id]));
+
+    std::unordered_map<std::string_view, uint32_t> name_indices;
+    auto add_name = [&](std::string_view name) {
+        auto it = name_indices.find(name);
+        if (it != name_indices.end()) return it->second;
+        uint32_t index = add_span(string_spans, name);
+        name_indices.emplace(name, index);
+        return index;
+    };
+
+    auto add_location = [&](uint32_t location_id) {
+        auto it = location_indices.find(location_id);
+        if (it != location_indices.end()) return it->second;
+
+        const Location& loc = program.Locations[location_id];
+        auto file = path_indices.find(int(loc.FileId));
+        if (file == path_indices.end()) file = path_indices.emplace(int(loc.FileId), add_path(source_files[loc.FileId].Path)).first;
+
+        locations.push_back({file->second, uint32_t(loc.Row), uint32_t(loc.Col)});
+        location_indices.emplace(location_id, uint32_t(locations.size() - 1));
+        return uint32_t(locations.size() - 1);
+    };
+
+    auto add_ops = [&](const std::vector<Operation>& source) {
+        for (Operation op : source) {
+            op.Loc = add_location(op.Loc);
+
+            if (op.Type == OpType::PUSH_STRING || op.Type == OpType::HERE) op.StringId = int(string_indices.at(op.StringId));
+            if (op.Type == OpType::CALL) op.IntegerValue = int(add_name(program.Bindings[op.IntegerValue].Name));
+            ops.push_back(op);
+        }
+    };
+
+    add_ops(module.Ops);
+    uint32_t top_level_op_count = uint32_t(ops.size());
+
+    for (int binding_id : module.Bindings) {
+        const Binding& binding = program.Bindings[binding_id];
+        uint32_t name_index = add_name(binding.Name);
+        uint32_t first_op = uint32_t(ops.size());
+        add_ops(binding.Body);
+        bindings.push_back({name_index, add_location(binding.Loc), first_op, uint32_t(ops.size() - first_op)});
+    }
+
+    CachedModuleHeader header{};
+    memcpy(header.Magic, MODULE_CACHE_MAGIC, sizeof(MODULE_CACHE_MAGIC));
+    header.OpTypeCount = static_cast<uint32_t>(OpType::COUNT);
+    header.OperationSize = sizeof(Operation);
+    header.SourceHash = module.SourceHash;
+    header.IncludeHash = include_hash;
+    header.Key = module.Key;
+    header.DependencyCount = uint32_t(dependencies.size());
+    header.PathCount = uint32_t(path_spans.size());
+    header.StringCount = uint32_t(string_spans.size());
+    header.LiteralCount = uint32_t(literals.size());
+    header.LocationCount = uint32_t(locations.size());
+    header.OpCount = uint32_t(ops.size());
+    header.TopLevelOpCount = top_level_op_count;
+    header.BindingCount = uint32_t(bindings.size());
+    header.BlobSize = uint32_t(blob.size());
+
+    string out;
+    append_record(out, header);
+    for (const auto& record : dependencies) append_record(out, record);
+    for (const auto& record : path_spans) append_record(out, record);
+    for (const auto& record : string_spans) append_record(out, record);
+    for (const auto& record : locations) append_record(out, record);
+    for (const auto& record : ops) append_record(out, record);
+    for (const auto& record : bindings) append_record(out, record);
+    out += blob;
+
+    header.ContentHash = hash_bytes(out.data() + sizeof(header), out.size() - sizeof(header));
+    memcpy(out.data(), &header, sizeof(header));
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(cache_path).parent_path(), ec);
+
+    // Written aside and renamed, so concurrent compilers never see a half-written entry
+    string temp_path = cache_path + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        if (!file.is_open()) return;
+        file.write(out.data(), std::streamsize(out.size()));
+        if (!file.good()) return;
+    }
+    std::filesystem::rename(temp_path, cache_path, ec);
+    if (ec) std::filesystem::remove(temp_path, ec);
+}
+
+Module& load_module(ModuleGraph& graph, Program& program, const string& path, const Token* use_token)
+{
+    std::error_code ec;
+    string key = std::filesystem::weakly_canonical(path, ec).string();
+    if (ec) key = path;
+
+    auto it = graph.Modules.find(key);
+    if (it != graph.Modules.end())
+    {
+        Module& module = *it->second;
+        if (module.State == ModuleState::PARSING)
+        {
+            compilation_error(use_token->Loc, "Cyclic `use` of `" + module.Path + "`");
+            exit(1);
+        }
+        return module;
+    }
+
+    Module& module = *graph.Modules.emplace(key, std::make_unique<Module>()).first->second;
+    module.Path = path;
+
+    int file_id = map_source_file(path);
+    if (file_id < 0)
+    {
+        compilation_error("File `" + path + "` not found in include directories");
+        exit(1);
+    }
+    module.SourceHash = hash_bytes(source_files[file_id].Data, source_files[file_id].Size);
+
+    // Only used files are cached, the entry file is always parsed
+    bool use_cache = use_token != nullptr && !graph.CacheDirectory.empty();
+    string cache_path = use_cache ? module_cache_path(graph.CacheDirectory, key) : "";
+
+    if (!use_cache || !load_cached_module(graph, program, module, cache_path, use_token))
+    {
+        module.Dependencies.clear();
+        module.Ops.clear();
+        module.Scope.clear();
+        module.Bindings.clear();
+
+        std::vector<Token> tokens = lex_file(path);
+        parse_tokens_as_operations(graph, program, module, tokens);
+
+        module.Key = module_key(module, graph.IncludeHash);
+        if (use_cache) store_cached_module(program, module, cache_path, graph.IncludeHash);
+    }
+
+    module.State = ModuleState::PARSED;
+    graph.Order.push_back(&module);
+
+    return module;
+}
+
+// Top-level operations of the entry file and everything it uses. Used files are placed before the ones
+// that use them, each file at most once. Files the graph has loaded for other entries are skipped
+void collect_operations(const ModuleGraph& graph, Program& program, const Module& entry)
+{
+    std::unordered_set<const Module*> used = {&entry};
+    std::vector<const Module*> pending = {&entry};
+    while (!pending.empty())
+    {
+        const Module* module = pending.back();
+        pending.pop_back();
+        for (const Module* dependency : module->Dependencies) {
+            if (used.insert(dependency).second) pending.push_back(dependency);
+        }
+    }
+
+    size_t total_ops = 0;
+    for (const Module* module : graph.Order) {
+        if (used.contains(module)) total_ops += module->Ops.size();
+    }
+
+    program.Ops.reserve(total_ops);
+    for (const Module* module : graph.Order) {
+        if (used.contains(module)) program.Ops.insert(program.Ops.end(), module->Ops.begin(), module->Ops.end());
+    }
+}
+
+// Parses the entry file together with everything it uses
+Program parse_program(const string& path, const std::vector<string>& include_paths, const string& cache_directory)
+{
+    Program program;
+    ModuleGraph graph(include_paths);
+    graph.CacheDirectory = cache_directory;
+    graph.IncludeHash = hash_include_paths(include_paths);
+
+    const Module& entry = load_module(graph, program, path, nullptr);
+    collect_operations(graph, program, entry);
+
+    return program;
+}
+
+uint64_t saturating_add(uint64_t a, uint64_t b)
+{
+    return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+}
+
+// Replaces `call`s of bindings either with their bodies or with calls of out-of-line procedures.
+// A binding is inlined when its expanded body has at most `threshold` operations, or when it's expanded
+// at most once in the whole program. Negative threshold inlines every binding.
+// Procedures are placed after the entry code as `proc` ... `ret`, and every `call` jumps to its `proc`.
+void inline_bindings(Program& program, int threshold)
+{
+    const std::vector<Binding>& bindings = program.Bindings;
+    size_t count = bindings.size();
+
+    // Bindings can only call bindings defined before them, so callers always have greater ids than callees
+    std::vector<uint64_t> uses(count, 0);
+    for (const auto& op : program.Ops) {
+        if (op.Type == OpType::CALL) uses[op.IntegerValue]++;
+    }
+    for (size_t id = count; id-- > 0;) {
+        if (uses[id] == 0) continue;
+        for (const auto& op : bindings[id].Body) {
+            if (op.Type == OpType::CALL) uses[op.IntegerValue] = saturating_add(uses[op.IntegerValue], uses[id]);
+        }
+    }
+
+    // `depth` is the deepest chain of procedure calls made while running the expanded body,
+    // counting the binding itself if it becomes a procedure. It sizes the return stack
+    std::vector<uint64_t> expanded_size(count, 0);
+    std::vector<bool> inlined(count, true);
+    std::vector<int> depth(count, 0);
+
+    // Only bodies that close every block they open, and have `do` and `else` inside of them, can be procedures.
+    // Calls to inlined bindings are walked through, because their bodies are part of the expansion
+    auto is_self_contained = [&](size_t id) {
+        int open = 0;
+        bool balanced = true;
+        auto walk = [&](auto& self, const std::vector<Operation>& body) -> void {
+            for (const auto& op : body) {
+                if (!balanced) return;
+                if (op.Type == OpType::IF || op.Type == OpType::WHILE) open++;
+                else if (op.Type == OpType::DO || op.Type == OpType::ELSE) balanced = open > 0;
+                else if (op.Type == OpType::END) balanced = open-- > 0;
+                else if (op.Type == OpType::CALL && inlined[op.IntegerValue]) self(self, bindings[op.IntegerValue].Body);
+            }
+        };
+        walk(walk, bindings[id].Body);
+        return balanced && open == 0;
+    };
+
+    for (size_t id = 0; id < count; ++id) {
+        uint64_t size = 0;
+        int max_depth = 0;
+        for (const auto& op : bindings[id].Body) {
+            if (op.Type != OpType::CALL)
+            {
+                size = saturating_add(size, 1);
+                continue;
+            }
+            size = saturating_add(size, inlined[op.IntegerValue] ? expanded_size[op.IntegerValue] : 1);
+            max_depth = std::max(max_depth, depth[op.IntegerValue]);
+        }
+        expanded_size[id] = size;
+        inlined[id] = threshold < 0 || size <= uint64_t(threshold) || uses[id] <= 1 || !is_self_contained(id);
+        depth[id] = inlined[id] ? max_depth : max_depth + 1;
+    }
+
+    program.CallDepth = 0;
+    for (const auto& op : program.Ops) {
+        if (op.Type == OpType::CALL) program.CallDepth = std::max(program.CallDepth, depth[op.IntegerValue]);
+    }
+
+    std::vector<Operation> ops;
+    std::vector<int> entries(count, -1);
+
+    auto expand = [&](auto& self, const std::vector<Operation>& source) -> void {
+        for (const auto& op : source) {
+            if (op.Type == OpType::CALL && inlined[op.IntegerValue]) self(self, bindings[op.IntegerValue].Body);
+            else ops.push_back(op);
+        }
+    };
+
+    expand(expand, program.Ops);
+
+    for (size_t id = 0; id < count; ++id) {
+        if (inlined[id] || uses[id] == 0) continue;
+
+        entries[id] = int(ops.size());
+        ops.emplace_back(OpType::PROC, int(id), bindings[id].Loc);
+        expand(expand, bindings[id].Body);
+        ops.emplace_back(OpType::RET, bindings[id].Loc);
+    }
+
+    for (auto& op : ops) {
+        if (op.Type == OpType::CALL) op.JumpTo = entries[op.IntegerValue];
+    }
+
+    program.Ops = std::move(ops);
+}
+
+void crossreference_blocks(Program& program)
+{
+    std::stack<int> crossreference_stack;
+
+    assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling. Not all operations should be handled in here");
+
+    std::vector<Operation>& ops = program.Ops;
+
+    for (int i = 0; i < int(ops.size()); ++i) {
+        const Operation& op = ops[i];
 
-    for (const auto& op : program) {
-        assert(static_cast<int>(OpType::COUNT) == 49, "Exhaustive operations handling");
+        switch (op.Type) {
+            case OpType::IF:
+            case OpType::WHILE:
+            {
+                crossreference_stack.push(i);
+                break;
+            }
+            case OpType::ELSE:
+            {
+                if (crossreference_stack.empty())
+                {
+                    compilation_error(program.Locations[op.Loc], "`else` operation can only be used in `if` block");
+                    exit(1);
+                }
+                int pos = crossreference_stack.top();
+                crossreference_stack.pop();
+                ops[pos].JumpTo = i + 1;
+                crossreference_stack.push(i);
+                break;
+            }
+            case OpType::DO:
+            {
+                if (crossreference_stack.empty())
+                {
+                    compilation_error(program.Locations[op.Loc], "`do` operation can only be used in `while` block");
+                    exit(1);
+                }
+                int top = crossreference_stack.top();
+                ops[i].JumpTo = top;
+                crossreference_stack.pop();
+                crossreference_stack.push(i);
+                break;
+            }
+            case OpType::END:
+            {
+                if (crossreference_stack.empty())
+                {
+                    compilation_error(program.Locations[op.Loc], "`end` operation can only be used to close other blocks");
+                    exit(1);
+                }
+                int pos = crossreference_stack.top();
+                crossreference_stack.pop();
+
+                switch (ops[pos].Type) {
+                    case OpType::IF:
+                    case OpType::ELSE:
+                    {
+                        ops[pos].JumpTo = i;
+                        ops[i].JumpTo = i + 1;
+                        break;
+                    }
+                    case OpType::DO:
+                    {
+                        ops[i].JumpTo = ops[pos].JumpTo;
+                        ops[pos].JumpTo = i + 1;
+                        break;
+                    }
+                    default:
+                    {
+                        compilation_error(program.Locations[op.Loc], "Only `if` and `while` blocks can be closed with `end` keyword");
+                        exit(1);
+                    }
+                }
+                break;
+            }
+            case OpType::PROC:
+            case OpType::RET:
+            {
+                // Blocks can't cross the boundary of the entry code or of a procedure
+                if (!crossreference_stack.empty())
+                {
+                    compilation_error(program.Locations[ops[crossreference_stack.top()].Loc], "Not all blocks was closed with `end` keyword");
+                    exit(1);
+                }
+                break;
+            }
+        }
+    }
+
+    if (!crossreference_stack.empty())
+    {
+        int latest_pos = crossreference_stack.top();
+        crossreference_stack.pop();
+
+        compilation_error(program.Locations[ops[latest_pos].Loc], "Not all blocks was closed with `end` keyword");
+        exit(1);
+    }
+}
+
+// Checks operations starting at `begin` until the end of the entry code or of the current procedure.
+// A `call` is checked as if the procedure body was written in place, the same way inlined bindings are
+void type_check_ops(const Program& program, size_t begin, std::stack<Type>& type_checking_stack)
+{
+    assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
+
+    for (size_t i = begin; i < program.Ops.size(); ++i) {
+        const Operation& op = program.Ops[i];
+
+        assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling");
 
         switch (op.Type)
         {
@@ -783,7 +1692,7 @@ void type_check_program(const std::vector<Operation>& program)
                 assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
 
                 if (type_checking_stack.size() < 2) {
-                    compilation_error(op.Loc, "Not enough arguments for `+` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `+` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -798,7 +1707,7 @@ void type_check_program(const std::vector<Operation>& program)
                     type_checking_stack.emplace(DataType::PTR, op.Loc);
                 }
                 else {
-                    compilation_error(op.Loc, "Invalid arguments types for `+` operation. Expected 2 `int`s or pair of `int` and `ptr`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Invalid arguments types for `+` operation. Expected 2 `int`s or pair of `int` and `ptr`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -808,7 +1717,7 @@ void type_check_program(const std::vector<Operation>& program)
                 assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
 
                 if (type_checking_stack.size() < 2) {
-                    compilation_error(op.Loc, "Not enough arguments for `-` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `-` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -823,7 +1732,7 @@ void type_check_program(const std::vector<Operation>& program)
                     type_checking_stack.emplace(DataType::PTR, op.Loc);
                 }
                 else {
-                    compilation_error(op.Loc, "Invalid arguments types for `-` operation. Expected 2 `int`s, or `ptr` and `int`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Invalid arguments types for `-` operation. Expected 2 `int`s, or `ptr` and `int`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -831,11 +1740,12 @@ void type_check_program(const std::vector<Operation>& program)
             case OpType::MUL:
             case OpType::DIV:
             case OpType::MOD:
+            case OpType::DIVMOD:
             {
                 assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
 
                 if (type_checking_stack.size() < 2) {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -845,8 +1755,9 @@ void type_check_program(const std::vector<Operation>& program)
                 type_checking_stack.pop();
                 if (a.Code == DataType::INT && b.Code == DataType::INT) {
                     type_checking_stack.emplace(DataType::INT, op.Loc);
+                    if (op.Type == OpType::DIVMOD) type_checking_stack.emplace(DataType::INT, op.Loc);
                 } else {
-                    compilation_error(op.Loc, "Invalid arguments types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Invalid arguments types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -858,7 +1769,7 @@ void type_check_program(const std::vector<Operation>& program)
                 assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
 
                 if (type_checking_stack.size() < 2) {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -872,7 +1783,7 @@ void type_check_program(const std::vector<Operation>& program)
                 } else if (a.Code == DataType::BOOL && b.Code == DataType::BOOL) {
                     type_checking_stack.emplace(DataType::BOOL, op.Loc);
                 } else {
-                    compilation_error(op.Loc, "Invalid arguments types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 `int`s or 2 `bool`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Invalid arguments types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 `int`s or 2 `bool`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -883,7 +1794,7 @@ void type_check_program(const std::vector<Operation>& program)
                 assert(static_cast<int>(DataType::COUNT) == 3, "Exhaustive data types handling");
 
                 if (type_checking_stack.size() < 2) {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -895,7 +1806,7 @@ void type_check_program(const std::vector<Operation>& program)
                 if (a.Code == DataType::INT && b.Code == DataType::INT) {
                     type_checking_stack.emplace(DataType::INT, op.Loc);
                 } else {
-                    compilation_error(op.Loc, "Invalid arguments types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Invalid arguments types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -908,7 +1819,7 @@ void type_check_program(const std::vector<Operation>& program)
             case OpType::GE:
             {
                 if (type_checking_stack.size() < 2) {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -916,13 +1827,17 @@ void type_check_program(const std::vector<Operation>& program)
                 type_checking_stack.pop();
                 Type b = type_checking_stack.top();
                 type_checking_stack.pop();
+                bool is_equality = op.Type == OpType::EQ || op.Type == OpType::NE;
                 if (a.Code == DataType::INT && b.Code == DataType::INT) {
                     type_checking_stack.emplace(DataType::BOOL, op.Loc);
+                } else if (is_equality && (a.Code == DataType::PTR || b.Code == DataType::PTR) && a.Code != DataType::BOOL && b.Code != DataType::BOOL) {
+                    // Pointers are only checked for equality, with each other or with `0` returned by failed `alloc`
+                    type_checking_stack.emplace(DataType::BOOL, op.Loc);
                 } else if (a.Code == DataType::BOOL && b.Code == DataType::BOOL) {
-                    compilation_error(op.Loc, "Use `band`, `bor` and `xor` operations to compare booleans. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Use `band`, `bor` and `xor` operations to compare booleans. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 } else {
-                    compilation_error(op.Loc, "Only integer values can be compared. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Only integer values can be compared, and pointers only with `==` and `!=`. Expected 2 `int`s, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -930,13 +1845,13 @@ void type_check_program(const std::vector<Operation>& program)
             case OpType::NOT:
             {
                 if (type_checking_stack.empty()) {
-                    compilation_error(op.Loc, "Not enough arguments for `not` operation. Expected 1 arguments, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `not` operation. Expected 1 arguments, but found 0");
                     exit(1);
                 }
                 Type a = type_checking_stack.top();
                 if (a.Code != DataType::BOOL)
                 {
-                    compilation_error(op.Loc, "Expected type `bool` for `not` operation, but found " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Expected type `bool` for `not` operation, but found " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
@@ -952,7 +1867,7 @@ void type_check_program(const std::vector<Operation>& program)
             {
                 if (type_checking_stack.empty())
                 {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 1 argument, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 1 argument, but found 0");
                     exit(1);
                 }
 
@@ -961,7 +1876,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (top.Code != DataType::BOOL)
                 {
-                    compilation_error(op.Loc, "Unexpected argument's type for " + HumanizedOpTypes.at(op.Type) + " operation. Expected type `bool`, but found " + HumanizedDataTypes.at(top.Code));
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument's type for " + HumanizedOpTypes.at(op.Type) + " operation. Expected type `bool`, but found " + HumanizedDataTypes.at(top.Code));
                     exit(1);
                 }
                 break;
@@ -983,11 +1898,16 @@ void type_check_program(const std::vector<Operation>& program)
                 break;
             }
             case OpType::LOAD8:
+            case OpType::LOAD16:
+            case OpType::LOAD32:
             case OpType::LOAD64:
+            case OpType::LOAD8S:
+            case OpType::LOAD16S:
+            case OpType::LOAD32S:
             {
                 if (type_checking_stack.empty())
                 {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 1 argument, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 1 argument, but found 0");
                     exit(1);
                 }
 
@@ -996,7 +1916,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (top.Code != DataType::PTR)
                 {
-                    compilation_error(op.Loc, "Unexpected argument type for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `ptr`, but found " + HumanizedDataTypes.at(top.Code));
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument type for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `ptr`, but found " + HumanizedDataTypes.at(top.Code));
                     exit(1);
                 }
 
@@ -1005,11 +1925,13 @@ void type_check_program(const std::vector<Operation>& program)
                 break;
             }
             case OpType::STORE8:
+            case OpType::STORE16:
+            case OpType::STORE32:
             case OpType::STORE64:
             {
                 if (type_checking_stack.size() < 2)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1020,31 +1942,60 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (a.Code != DataType::INT || b.Code != DataType::PTR)
                 {
-                    compilation_error(op.Loc, "Unexpected argument's types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `int` and `ptr`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument's types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `int` and `ptr`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
                 break;
             }
-            case OpType::USE:
+            case OpType::ALLOC:
+            case OpType::ARENA_ALLOC:
             {
-                assert(false, "Unreachable. All `use` operations should be eliminated at the compilation step");
+                if (type_checking_stack.empty())
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 1 argument, but found 0");
+                    exit(1);
+                }
+
+                Type top = type_checking_stack.top();
+                type_checking_stack.pop();
+
+                if (top.Code != DataType::INT)
+                {
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument type for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `int`, but found " + HumanizedDataTypes.at(top.Code));
+                    exit(1);
+                }
+
+                type_checking_stack.emplace(DataType::PTR, op.Loc);
+                break;
             }
-            case OpType::PUT:
+            case OpType::FREE:
             {
                 if (type_checking_stack.empty())
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `put` operation. Expected 1 argument, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `free` operation. Expected 1 argument, but found 0");
                     exit(1);
                 }
+
                 Type top = type_checking_stack.top();
                 type_checking_stack.pop();
+
+                if (top.Code != DataType::PTR)
+                {
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument type for `free` operation. Expected `ptr`, but found " + HumanizedDataTypes.at(top.Code));
+                    exit(1);
+                }
                 break;
             }
-            case OpType::FPUTS:
+            case OpType::ARENA_RESET:
+                break;
+            case OpType::MEMCPY:
+            case OpType::MEMSET:
+            case OpType::MEMCMP:
+            case OpType::MEMCHR:
             {
                 if (type_checking_stack.size() < 3)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `fputs` operation. Expected 3 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 3 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1055,55 +2006,167 @@ void type_check_program(const std::vector<Operation>& program)
                 Type c = type_checking_stack.top();
                 type_checking_stack.pop();
 
-                if (a.Code != DataType::INT || b.Code != DataType::PTR || c.Code != DataType::INT)
+                // `memset` and `memchr` take the byte value in place of the source
+                DataType source = op.Type == OpType::MEMSET || op.Type == OpType::MEMCHR ? DataType::INT : DataType::PTR;
+                if (a.Code != DataType::INT || b.Code != source || c.Code != DataType::PTR)
                 {
-                    compilation_error(op.Loc, "Unexpected argument's types for `fputs` operation. Expected `int`, `ptr` and `int`, but found " + HumanizedDataTypes.at(a.Code) + ", " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(c.Code));
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument's types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `ptr`, " + HumanizedDataTypes.at(source) + " and `int`, but found " + HumanizedDataTypes.at(c.Code) + ", " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
                     exit(1);
                 }
 
+                if (op.Type == OpType::MEMCMP || op.Type == OpType::MEMCHR) type_checking_stack.emplace(DataType::INT, op.Loc);
                 break;
             }
-            case OpType::COPY:
+            case OpType::STRLEN:
             {
                 if (type_checking_stack.empty())
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `copy` operation. Expected 1 argument, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `strlen` operation. Expected 1 argument, but found 0");
                     exit(1);
                 }
 
-                type_checking_stack.push(type_checking_stack.top());
+                Type top = type_checking_stack.top();
+                type_checking_stack.pop();
 
-                break;
-            }
-            case OpType::OVER:
-            {
-                if (type_checking_stack.size() < 2)
+                if (top.Code != DataType::PTR)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `over` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument type for `strlen` operation. Expected `ptr`, but found " + HumanizedDataTypes.at(top.Code));
                     exit(1);
                 }
 
-                Type a = type_checking_stack.top();
-                type_checking_stack.pop();
-
-                Type b = type_checking_stack.top();
-                type_checking_stack.pop();
-
-                type_checking_stack.push(b);
-                type_checking_stack.push(a);
-                type_checking_stack.push(b);
-
+                type_checking_stack.emplace(DataType::INT, op.Loc);
                 break;
             }
-            case OpType::SWAP:
+            case OpType::STREQ:
             {
-                if (type_checking_stack.size() < 2)
+                if (type_checking_stack.size() < 4)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `swap` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `streq` operation. Expected 4 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
-                Type a = type_checking_stack.top();
+                // Two strings, each is the size under the pointer
+                for (int i = 0; i < 2; ++i)
+                {
+                    Type pointer = type_checking_stack.top();
+                    type_checking_stack.pop();
+                    Type size = type_checking_stack.top();
+                    type_checking_stack.pop();
+
+                    if (pointer.Code != DataType::PTR || size.Code != DataType::INT)
+                    {
+                        compilation_error(program.Locations[op.Loc], "Unexpected argument's types for `streq` operation. Expected `int` and `ptr` for each string, but found " + HumanizedDataTypes.at(size.Code) + " and " + HumanizedDataTypes.at(pointer.Code));
+                        exit(1);
+                    }
+                }
+
+                type_checking_stack.emplace(DataType::BOOL, op.Loc);
+                break;
+            }
+            case OpType::USE:
+            {
+                assert(false, "Unreachable. All `use` operations should be eliminated at the compilation step");
+            }
+            case OpType::PUT:
+            case OpType::PUTD:
+            case OpType::PRINT:
+            case OpType::PRINTD:
+            {
+                if (type_checking_stack.empty())
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 1 argument, but found 0");
+                    exit(1);
+                }
+                type_checking_stack.pop();
+                break;
+            }
+            case OpType::FMT:
+            case OpType::FMTD:
+            {
+                if (type_checking_stack.size() < 2)
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for " + HumanizedOpTypes.at(op.Type) + " operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    exit(1);
+                }
+
+                Type a = type_checking_stack.top();
+                type_checking_stack.pop();
+                Type b = type_checking_stack.top();
+                type_checking_stack.pop();
+
+                if (a.Code != DataType::INT || b.Code != DataType::PTR)
+                {
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument's types for " + HumanizedOpTypes.at(op.Type) + " operation. Expected `ptr` and `int`, but found " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(a.Code));
+                    exit(1);
+                }
+
+                type_checking_stack.emplace(DataType::INT, op.Loc);
+                break;
+            }
+            case OpType::FPUTS:
+            {
+                if (type_checking_stack.size() < 3)
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `fputs` operation. Expected 3 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    exit(1);
+                }
+
+                Type a = type_checking_stack.top();
+                type_checking_stack.pop();
+                Type b = type_checking_stack.top();
+                type_checking_stack.pop();
+                Type c = type_checking_stack.top();
+                type_checking_stack.pop();
+
+                if (a.Code != DataType::INT || b.Code != DataType::PTR || c.Code != DataType::INT)
+                {
+                    compilation_error(program.Locations[op.Loc], "Unexpected argument's types for `fputs` operation. Expected `int`, `ptr` and `int`, but found " + HumanizedDataTypes.at(a.Code) + ", " + HumanizedDataTypes.at(b.Code) + " and " + HumanizedDataTypes.at(c.Code));
+                    exit(1);
+                }
+
+                break;
+            }
+            case OpType::COPY:
+            {
+                if (type_checking_stack.empty())
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `copy` operation. Expected 1 argument, but found 0");
+                    exit(1);
+                }
+
+                type_checking_stack.push(type_checking_stack.top());
+
+                break;
+            }
+            case OpType::OVER:
+            {
+                if (type_checking_stack.size() < 2)
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `over` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    exit(1);
+                }
+
+                Type a = type_checking_stack.top();
+                type_checking_stack.pop();
+
+                Type b = type_checking_stack.top();
+                type_checking_stack.pop();
+
+                type_checking_stack.push(b);
+                type_checking_stack.push(a);
+                type_checking_stack.push(b);
+
+                break;
+            }
+            case OpType::SWAP:
+            {
+                if (type_checking_stack.size() < 2)
+                {
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `swap` operation. Expected 2 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    exit(1);
+                }
+
+                Type a = type_checking_stack.top();
                 type_checking_stack.pop();
 
                 Type b = type_checking_stack.top();
@@ -1118,7 +2181,7 @@ void type_check_program(const std::vector<Operation>& program)
             {
                 if (type_checking_stack.size() < 4)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `2swap` operation. Expected 4 arguments, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `2swap` operation. Expected 4 arguments, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1145,7 +2208,7 @@ void type_check_program(const std::vector<Operation>& program)
             {
                 if (type_checking_stack.empty())
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `drop` operation. Expected 1 argument, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `drop` operation. Expected 1 argument, but found 0");
                     exit(1);
                 }
 
@@ -1157,7 +2220,7 @@ void type_check_program(const std::vector<Operation>& program)
             {
                 if (type_checking_stack.size() < 3)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `rot` operation. Expected 3 argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `rot` operation. Expected 3 argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1178,7 +2241,7 @@ void type_check_program(const std::vector<Operation>& program)
             {
                 if (type_checking_stack.empty())
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall0` operation. Expected 1 argument, but found 0");
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall0` operation. Expected 1 argument, but found 0");
                     exit(1);
                 }
 
@@ -1192,7 +2255,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (int(type_checking_stack.size()) < n + 1)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall1` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall1` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1208,7 +2271,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (int(type_checking_stack.size()) < n + 1)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall2` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall2` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1224,7 +2287,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (int(type_checking_stack.size()) < n + 1)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall3` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall3` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1240,7 +2303,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (int(type_checking_stack.size()) < n + 1)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall4` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall4` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1256,7 +2319,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (int(type_checking_stack.size()) < n + 1)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall5` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall5` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1272,7 +2335,7 @@ void type_check_program(const std::vector<Operation>& program)
 
                 if (int(type_checking_stack.size()) < n + 1)
                 {
-                    compilation_error(op.Loc, "Not enough arguments for `syscall6` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
+                    compilation_error(program.Locations[op.Loc], "Not enough arguments for `syscall6` operation. Expected " + std::to_string((n + 1)) + " argument, but found " + std::to_string(type_checking_stack.size()));
                     exit(1);
                 }
 
@@ -1282,587 +2345,3847 @@ void type_check_program(const std::vector<Operation>& program)
                 type_checking_stack.emplace(DataType::INT, op.Loc);
                 break;
             }
+            case OpType::CALL:
+            {
+                type_check_ops(program, op.JumpTo + 1, type_checking_stack);
+                break;
+            }
+            case OpType::PROC:
+            case OpType::RET:
+            {
+                return;
+            }
             default:
                 assert(false, "Unreachable");
         }
     }
+}
+
+void type_check_program(const Program& program)
+{
+    std::stack<Type> type_checking_stack;
+
+    type_check_ops(program, 0, type_checking_stack);
 
     if (!type_checking_stack.empty())
     {
         Type top = type_checking_stack.top();
-        cerr << top.Loc << ": ERROR: Unhandled data in the stack." << endl <<
+        cerr << location_view(program.Locations[top.Loc]) << ": ERROR: Unhandled data in the stack." << endl <<
             "Stack size: " << type_checking_stack.size() << endl <<
             "Stack values:" << endl;
         while (!type_checking_stack.empty())
         {
             top = type_checking_stack.top();
             type_checking_stack.pop();
-            cerr << "  " << top.Loc << ": " << HumanizedDataTypes.at(top.Code) << endl;
+            cerr << "  " << location_view(program.Locations[top.Loc]) << ": " << HumanizedDataTypes.at(top.Code) << endl;
         }
         exit(1);
     }
 }
 
-void generate_nasm_linux_x86_64(const string& output_file_path, std::vector<Operation> program)
+bool is_constant_push(const Operation& op)
 {
-    std::ofstream out(output_file_path);
-
-    if (!out.is_open()) {
-        compilation_error("Can't open file: " + output_file_path);
-        exit(1);
-    }
+    return op.Type == OpType::PUSH_INT || op.Type == OpType::TRUE || op.Type == OpType::FALSE;
+}
 
-    std::map<string, int> strings;
+int64_t constant_value(const Operation& op)
+{
+    if (op.Type == OpType::TRUE) return 1;
+    if (op.Type == OpType::FALSE) return 0;
+    return op.IntegerValue;
+}
 
-    string output_content;
-    complete_string(output_content, "BITS 64");
+// Evaluates a binary operation the way the generated code does: on 64-bit values, with unsigned division
+// and shift counts taken modulo 64. Fails when the result can't be pushed as an `int` again
+bool fold_binary(OpType type, int64_t a, int64_t b, int64_t& result)
+{
+    uint64_t x = a;
+    uint64_t y = b;
 
-    bool is_put_needed;
-    for (const auto& op : program)
+    switch (type)
     {
-        if (op.Type == OpType::PUT)
+        case OpType::PLUS: result = int64_t(x + y); break;
+        case OpType::MINUS: result = int64_t(x - y); break;
+        case OpType::MUL: result = int64_t(x * y); break;
+        case OpType::DIV:
+        case OpType::MOD:
         {
-            is_put_needed = true;
+            if (y == 0) return false;
+            result = int64_t(type == OpType::DIV ? x / y : x % y);
             break;
         }
+        case OpType::BOR: result = int64_t(x | y); break;
+        case OpType::BAND: result = int64_t(x & y); break;
+        case OpType::XOR: result = int64_t(x ^ y); break;
+        case OpType::SHL: result = int64_t(x << (y & 63)); break;
+        case OpType::SHR: result = int64_t(x >> (y & 63)); break;
+        case OpType::EQ: result = a == b; break;
+        case OpType::NE: result = a != b; break;
+        case OpType::LT: result = a < b; break;
+        case OpType::GT: result = a > b; break;
+        case OpType::LE: result = a <= b; break;
+        case OpType::GE: result = a >= b; break;
+        default: return false;
     }
-    if (is_put_needed)
+
+    return result >= INT32_MIN && result <= INT32_MAX;
+}
+
+// Multiplication, division and modulus of the unsigned values by a power of two are shifts and a mask.
+// Rewrites the operation and its constant operand in place
+bool reduce_strength(OpType& type, int64_t& operand)
+{
+    if (operand <= 0 || (operand & (operand - 1)) != 0) return false;
+
+    int shift = std::countr_zero(uint64_t(operand));
+    switch (type)
     {
-        complete_string(output_content, "; -- put --");
-        complete_string(output_content, "put:");
-        complete_string(output_content, "    mov     r9, -3689348814741910323");
-        complete_string(output_content, "    sub     rsp, 40");
-        complete_string(output_content, "    mov     BYTE [rsp+31], 10");
-        complete_string(output_content, "    lea     rcx, [rsp+30]");
-        complete_string(output_content, ".L2:");
-        complete_string(output_content, "    mov     rax, rdi");
-        complete_string(output_content, "    lea     r8, [rsp+32]");
-        complete_string(output_content, "    mul     r9");
-        complete_string(output_content, "    mov     rax, rdi");
-        complete_string(output_content, "    sub     r8, rcx");
-        complete_string(output_content, "    shr     rdx, 3");
-        complete_string(output_content, "    lea     rsi, [rdx+rdx*4]");
-        complete_string(output_content, "    add     rsi, rsi");
-        complete_string(output_content, "    sub     rax, rsi");
-        complete_string(output_content, "    add     eax, 48");
-        complete_string(output_content, "    mov     BYTE [rcx], al");
-        complete_string(output_content, "    mov     rax, rdi");
-        complete_string(output_content, "    mov     rdi, rdx");
-        complete_string(output_content, "    mov     rdx, rcx");
-        complete_string(output_content, "    sub     rcx, 1");
-        complete_string(output_content, "    cmp     rax, 9");
-        complete_string(output_content, "    ja      .L2");
-        complete_string(output_content, "    lea     rax, [rsp+32]");
-        complete_string(output_content, "    mov     edi, 1");
-        complete_string(output_content, "    sub     rdx, rax");
-        complete_string(output_content, "    xor     eax, eax");
-        complete_string(output_content, "    lea     rsi, [rsp+32+rdx]");
-        complete_string(output_content, "    mov     rdx, r8");
-        complete_string(output_content, "    mov     rax, 1");
-        complete_string(output_content, "    syscall");
-        complete_string(output_content, "    add     rsp, 40");
-        complete_string(output_content, "    ret\n");
+        case OpType::MUL: type = OpType::SHL; operand = shift; return true;
+        case OpType::DIV: type = OpType::SHR; operand = shift; return true;
+        case OpType::MOD: type = OpType::BAND; operand = operand - 1; return true;
+        default: return false;
     }
+}
+
+// Rewrites `*`, `/` and `%` right after a power of two pushed as a constant without `-O`. Operations keep
+// their places, so no jumps have to be relinked
+void reduce_constant_strength(Program& program)
+{
+    std::vector<Operation>& ops = program.Ops;
+
+    for (size_t i = 1; i < ops.size(); ++i)
+    {
+        if (ops[i - 1].Type != OpType::PUSH_INT) continue;
 
-    complete_string(output_content, "section .text");
-    complete_string(output_content, "    global _start\n");
-    complete_string(output_content, "_start:");
+        OpType type = ops[i].Type;
+        int64_t operand = ops[i - 1].IntegerValue;
+        if (!reduce_strength(type, operand)) continue;
 
-    assert(static_cast<int>(OpType::COUNT) == 49, "Exhaustive operations handling");
+        ops[i - 1].IntegerValue = int(operand);
+        ops[i].Type = type;
+    }
+}
 
-    for (size_t i = 0; i < program.size(); ++i) {
-        Operation op = program[i];
+// Jump target of every operation as a label operation and an offset from it. Passes that remove
+// operations keep these label operations alive as long as anything jumps to them
+std::vector<std::pair<int, int>> jump_anchors(const std::vector<Operation>& ops)
+{
+    std::vector<std::pair<int, int>> anchors(ops.size(), {-1, 0});
 
+    for (int i = 0; i < int(ops.size()); ++i)
+    {
+        const Operation& op = ops[i];
         switch (op.Type)
         {
-            case OpType::PUSH_INT:
+            case OpType::IF:
             {
-                complete_string(output_content, "    ; -- push int -- ");
-                complete_string(output_content, "    push    " + std::to_string(op.IntegerValue));
+                if (ops[op.JumpTo - 1].Type == OpType::ELSE) anchors[i] = {op.JumpTo - 1, 1};
+                else anchors[i] = {op.JumpTo, 0};
                 break;
             }
-            case OpType::PUSH_STRING:
+            case OpType::DO: anchors[i] = {op.JumpTo - 1, 1}; break;
+            case OpType::END: anchors[i] = op.JumpTo < i ? std::pair{op.JumpTo, 0} : std::pair{i, 1}; break;
+            case OpType::ELSE:
+            case OpType::CALL: anchors[i] = {op.JumpTo, 0}; break;
+            default: break;
+        }
+    }
+
+    return anchors;
+}
+
+// Points jumps of `ops` back to their label operations. `origins` holds the original index
+// of every operation, or -1 for the ones a pass created
+void relink_jumps(std::vector<Operation>& ops, const std::vector<int>& origins, const std::vector<std::pair<int, int>>& anchors)
+{
+    std::vector<int> new_indices(anchors.size(), -1);
+    for (size_t k = 0; k < ops.size(); ++k)
+    {
+        if (origins[k] >= 0) new_indices[origins[k]] = int(k);
+    }
+
+    for (size_t k = 0; k < ops.size(); ++k)
+    {
+        if (origins[k] < 0 || anchors[origins[k]].first < 0) continue;
+
+        auto [label_op, offset] = anchors[origins[k]];
+        assert(new_indices[label_op] >= 0, "Jump to a removed operation");
+        ops[k].JumpTo = new_indices[label_op] + offset;
+    }
+}
+
+// Evaluates operations on constants at compile time. Constants on top of the stack are carried
+// through arithmetic and stack shuffles and pushed only when some other operation needs them.
+// `if` and `do` with a constant condition are removed together with the code they never run.
+// Jumps are kept pointing to the same label operations, which survive unless their whole block is removed
+void fold_constants(Program& program)
+{
+    const std::vector<Operation>& ops = program.Ops;
+
+    assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling. Not all operations should be handled in here");
+
+    std::vector<std::pair<int, int>> anchors = jump_anchors(ops);
+
+    std::vector<Operation> folded;
+    std::vector<int> origins;
+    std::vector<Operation> pending;
+
+    folded.reserve(ops.size());
+
+    auto flush = [&]() {
+        for (const Operation& constant : pending)
+        {
+            folded.push_back(constant);
+            origins.push_back(-1);
+        }
+        pending.clear();
+    };
+
+    for (int i = 0; i < int(ops.size()); ++i)
+    {
+        const Operation& op = ops[i];
+        size_t known = pending.size();
+
+        switch (op.Type)
+        {
+            case OpType::PUSH_INT:
+            case OpType::TRUE:
+            case OpType::FALSE:
             {
-                complete_string(output_content, "    ; -- push str --");
-                complete_string(output_content, "    push    " + std::to_string(op.StringValue.size()));
-                auto it = strings.find(op.StringValue);
-                if (it == strings.end())
-                {
-                    strings[op.StringValue] = int(strings.size());
-                }
-                complete_string(output_content, "    push    str_" + std::to_string(strings.at(op.StringValue)));
-                break;
+                pending.push_back(Operation(OpType::PUSH_INT, int(constant_value(op)), op.Loc));
+                continue;
             }
             case OpType::PLUS:
-            {
-                complete_string(output_content, "    ; -- plus --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    add     rax, rbx");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::MINUS:
-            {
-                complete_string(output_content, "    ; -- minus --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    sub     rbx, rax");
-                complete_string(output_content, "    push    rbx");
-                break;
-            }
             case OpType::MUL:
-            {
-                complete_string(output_content, "    ; -- multiply --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    imul    rax, rbx");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::DIV:
-            {
-                complete_string(output_content, "    ; -- division --");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    xor     rdx, rdx");
-                complete_string(output_content, "    div     rbx");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::MOD:
-            {
-                complete_string(output_content, "    ; -- mod --");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    xor     rdx, rdx");
-                complete_string(output_content, "    div     rbx");
-                complete_string(output_content, "    push    rdx");
-                break;
-            }
             case OpType::BOR:
-            {
-                complete_string(output_content, "    ; -- binary or --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    or      rax, rbx");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::BAND:
-            {
-                complete_string(output_content, "    ; -- binary and --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    and     rax, rbx");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::XOR:
-            {
-                complete_string(output_content, "    ; -- xor --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    xor     rax, rbx");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::SHL:
-            {
-                complete_string(output_content, "    ; -- shift left --");
-                complete_string(output_content, "    pop     rcx");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    shl     rax, cl");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::SHR:
-            {
-                complete_string(output_content, "    ; -- shift right --");
-                complete_string(output_content, "    pop     rcx");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    shr     rax, cl");
-                complete_string(output_content, "    push    rax");
-                break;
-            }
             case OpType::EQ:
-            {
-                complete_string(output_content, "    ; -- equal --");
-                complete_string(output_content, "    mov     rcx, 0");
-                complete_string(output_content, "    mov     rdx, 1");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    cmp     rax, rbx");
-                complete_string(output_content, "    cmove   rcx, rdx");
-                complete_string(output_content, "    push    rcx");
-                break;
-            }
             case OpType::NE:
-            {
-                complete_string(output_content, "    ; -- not equal --");
-                complete_string(output_content, "    mov     rcx, 0");
-                complete_string(output_content, "    mov     rdx, 1");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    cmp     rax, rbx");
-                complete_string(output_content, "    cmovne  rcx, rdx");
-                complete_string(output_content, "    push    rcx");
-                break;
-            }
             case OpType::LT:
-            {
-                complete_string(output_content, "    ; -- less --");
-                complete_string(output_content, "    mov     rcx, 0");
-                complete_string(output_content, "    mov     rdx, 1");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    cmp     rbx, rax");
-                complete_string(output_content, "    cmovl   rcx, rdx");
-                complete_string(output_content, "    push    rcx");
-                break;
-            }
             case OpType::GT:
-            {
-                complete_string(output_content, "    ; -- greater --");
-                complete_string(output_content, "    mov     rcx, 0");
-                complete_string(output_content, "    mov     rdx, 1");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    cmp     rbx, rax");
-                complete_string(output_content, "    cmovg   rcx, rdx");
-                complete_string(output_content, "    push    rcx");
-                break;
-            }
             case OpType::LE:
+            case OpType::GE:
             {
-                complete_string(output_content, "    ; -- less or equal --");
-                complete_string(output_content, "    mov     rcx, 0");
-                complete_string(output_content, "    mov     rdx, 1");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    cmp     rbx, rax");
-                complete_string(output_content, "    cmovle  rcx, rdx");
-                complete_string(output_content, "    push    rcx");
-                break;
+                int64_t result;
+                if (known < 2 || !fold_binary(op.Type, pending[known - 2].IntegerValue, pending[known - 1].IntegerValue, result))
+                {
+                    OpType reduced = op.Type;
+                    int64_t operand = known > 0 ? pending.back().IntegerValue : 0;
+                    if (known == 0 || !reduce_strength(reduced, operand)) break;
+
+                    pending.back() = Operation(OpType::PUSH_INT, int(operand), pending.back().Loc);
+                    flush();
+                    folded.push_back(op);
+                    folded.back().Type = reduced;
+                    origins.push_back(i);
+                    continue;
+                }
+                pending.pop_back();
+                pending.back() = Operation(OpType::PUSH_INT, int(result), op.Loc);
+                continue;
             }
-            case OpType::GE:
+            case OpType::DIVMOD:
             {
-                complete_string(output_content, "    ; -- greater or equal --");
-                complete_string(output_content, "    mov     rcx, 0");
-                complete_string(output_content, "    mov     rdx, 1");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    cmp     rbx, rax");
-                complete_string(output_content, "    cmovge  rcx, rdx");
-                complete_string(output_content, "    push    rcx");
-                break;
+                int64_t quotient, remainder;
+                if (known < 2) break;
+                if (!fold_binary(OpType::DIV, pending[known - 2].IntegerValue, pending[known - 1].IntegerValue, quotient)) break;
+                if (!fold_binary(OpType::MOD, pending[known - 2].IntegerValue, pending[known - 1].IntegerValue, remainder)) break;
+                pending[known - 2] = Operation(OpType::PUSH_INT, int(quotient), op.Loc);
+                pending[known - 1] = Operation(OpType::PUSH_INT, int(remainder), op.Loc);
+                continue;
             }
             case OpType::NOT:
             {
-                complete_string(output_content, "    ; -- not --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    xor     rax, 1");
-                complete_string(output_content, "    push    rax");
-                break;
+                if (known < 1) break;
+                pending.back() = Operation(OpType::PUSH_INT, pending.back().IntegerValue ^ 1, op.Loc);
+                continue;
             }
-            case OpType::TRUE:
+            case OpType::COPY:
+            case OpType::OVER:
             {
-                complete_string(output_content, "    ; -- true --");
-                complete_string(output_content, "    push    1");
-                break;
+                size_t depth = op.Type == OpType::COPY ? 1 : 2;
+                if (known < depth) break;
+                pending.push_back(pending[known - depth]);
+                continue;
             }
-            case OpType::FALSE:
+            case OpType::SWAP:
             {
-                complete_string(output_content, "    ; -- false --");
-                complete_string(output_content, "    push    0");
-                break;
+                if (known < 2) break;
+                std::swap(pending[known - 1], pending[known - 2]);
+                continue;
             }
-            case OpType::IF:
+            case OpType::SWAP2:
             {
-                complete_string(output_content, "    ; -- if --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    mov     rbx, 0");
-                complete_string(output_content, "    cmp     rax, rbx");
-                complete_string(output_content, "    je      addr_" + std::to_string(op.JumpTo));
-                break;
+                if (known < 4) break;
+                std::swap(pending[known - 4], pending[known - 2]);
+                std::swap(pending[known - 3], pending[known - 1]);
+                continue;
             }
-            case OpType::ELSE:
+            case OpType::ROT:
             {
-                complete_string(output_content, "    ; -- else --");
-                complete_string(output_content, "    jmp     addr_" + std::to_string(op.JumpTo));
-                complete_string(output_content, "    addr_" + std::to_string(i+1) + ":");
-                break;
+                if (known < 3) break;
+                std::rotate(pending.end() - 3, pending.end() - 1, pending.end());
+                continue;
             }
-            case OpType::END:
+            case OpType::DROP:
             {
-                complete_string(output_content, "    ; -- end --");
-                if (program[op.JumpTo].Type == OpType::WHILE)
-                {
-                    complete_string(output_content, "    jmp    addr_" + std::to_string(op.JumpTo));
-                }
-                complete_string(output_content, "addr_" + std::to_string(i) + ":");
-                break;
+                if (known < 1) break;
+                pending.pop_back();
+                continue;
             }
+            case OpType::IF:
             case OpType::DO:
             {
-                complete_string(output_content, "    ; -- do --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    mov     rbx, 0");
-                complete_string(output_content, "    cmp     rax, rbx");
-                complete_string(output_content, "    je      addr_" + std::to_string(op.JumpTo-1));
-                break;
-            }
-            case OpType::WHILE:
-            {
-                complete_string(output_content, "    ; -- while --");
-                complete_string(output_content, "    addr_" + std::to_string(i) + ":");
-                break;
-            }
-            case OpType::BIND:
-            {
-                assert(false, "Unreachable. All bindings should be expanded at the compilation step");
-            }
-            case OpType::MEM:
-            {
-                complete_string(output_content, "    ; -- mem --");
-                complete_string(output_content, "    push    mem");
-                break;
+                if (known < 1) break;
+                bool taken = pending.back().IntegerValue != 0;
+                pending.pop_back();
+                // Both `if` and `do` jump right past the code that runs only when the condition holds
+                if (!taken) i = op.JumpTo - 1;
+                continue;
             }
-            case OpType::LOAD8:
-            {
-                complete_string(output_content, "    ; -- load8 --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    xor     rbx, rbx");
-                complete_string(output_content, "    mov     bl, [rax]");
-                complete_string(output_content, "    push    rbx");
+            default:
                 break;
+        }
+
+        flush();
+        folded.push_back(op);
+        origins.push_back(i);
+    }
+
+    flush();
+
+    relink_jumps(folded, origins, anchors);
+    program.Ops = std::move(folded);
+}
+
+// `exit` and `exit_group` syscalls with their number pushed right before them never return
+bool is_exit_syscall(const std::vector<Operation>& ops, size_t i)
+{
+    if (i == 0 || ops[i].Type < OpType::SYSCALL0 || ops[i].Type > OpType::SYSCALL6) return false;
+
+    const Operation& number = ops[i - 1];
+    return number.Type == OpType::PUSH_INT && (number.IntegerValue == 60 || number.IntegerValue == 231);
+}
+
+bool is_label_operation(OpType type)
+{
+    return type == OpType::ELSE || type == OpType::END || type == OpType::WHILE || type == OpType::PROC;
+}
+
+// Removes code that can't run: `else` arms nothing jumps to anymore, operations after an exit syscall
+// up to the next label, and procedures without calls. Runs until nothing changes, since each removal
+// may drop the last jump to another label or the last call of another procedure
+void eliminate_dead_code(Program& program)
+{
+    std::vector<Operation>& ops = program.Ops;
+    std::vector<bool> removed(ops.size(), false);
+
+    assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling. Not all operations should be handled in here");
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        std::vector<int> jumps(ops.size() + 1, 0);
+        for (size_t i = 0; i < ops.size(); ++i)
+        {
+            if (!removed[i] && (ops[i].Type == OpType::IF || ops[i].Type == OpType::CALL)) ++jumps[ops[i].JumpTo];
+        }
+
+        auto remove = [&](size_t from, size_t to) {
+            for (size_t k = from; k < to; ++k)
+            {
+                changed = changed || !removed[k];
+                removed[k] = true;
             }
-            case OpType::STORE8:
+        };
+
+        for (size_t i = 0; i < ops.size(); ++i)
+        {
+            if (removed[i]) continue;
+
+            const Operation& op = ops[i];
+
+            if (op.Type == OpType::ELSE && jumps[i + 1] == 0)
+            {
+                remove(i, op.JumpTo);
+            }
+            else if (op.Type == OpType::PROC && jumps[i] == 0)
+            {
+                size_t end = i + 1;
+                while (end < ops.size() && ops[end].Type != OpType::PROC) ++end;
+                remove(i, end);
+            }
+            else if (is_exit_syscall(ops, i) && !removed[i - 1])
+            {
+                size_t end = i + 1;
+                while (end < ops.size() && !is_label_operation(ops[end].Type)) ++end;
+                remove(i + 1, end);
+            }
+        }
+    }
+
+    std::vector<std::pair<int, int>> anchors = jump_anchors(ops);
+    std::vector<Operation> alive;
+    std::vector<int> origins;
+
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (removed[i]) continue;
+        alive.push_back(ops[i]);
+        origins.push_back(int(i));
+    }
+
+    relink_jumps(alive, origins, anchors);
+    program.Ops = std::move(alive);
+}
+
+// "00".."99" for formatting two digits at once
+class DigitPairs
+{
+public:
+    char Bytes[200];
+};
+
+DigitPairs make_digit_pairs()
+{
+    DigitPairs pairs{};
+    for (int k = 0; k < 100; ++k)
+    {
+        pairs.Bytes[2 * k] = char('0' + k / 10);
+        pairs.Bytes[2 * k + 1] = char('0' + k % 10);
+    }
+    return pairs;
+}
+
+const DigitPairs DIGIT_PAIRS = make_digit_pairs();
+
+// Writes `value` in decimal right before `end` and returns where the digits start
+char* format_decimal(uint64_t value, char* end)
+{
+    while (value >= 100)
+    {
+        end -= 2;
+        memcpy(end, DIGIT_PAIRS.Bytes + 2 * (value % 100), 2);
+        value /= 100;
+    }
+
+    if (value >= 10)
+    {
+        end -= 2;
+        memcpy(end, DIGIT_PAIRS.Bytes + 2 * value, 2);
+    }
+    else *--end = char('0' + value);
+
+    return end;
+}
+
+// Writes the number to `out` the way the number operations do and returns the number of bytes
+size_t format_number(uint64_t value, bool is_signed, char* out)
+{
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    bool negative = is_signed && int64_t(value) < 0;
+    char* begin = format_decimal(negative ? 0 - value : value, end);
+    if (negative) *--begin = '-';
+    memcpy(out, begin, size_t(end - begin));
+    return size_t(end - begin);
+}
+
+// Memory of `alloc` and `free`. Blocks are bumped from one region reserved on the first allocation, their
+// sizes rounded up to a power of two. Each block has a 16-byte header with its size class, and freed blocks
+// are reused through a list per class. `arena-alloc` bumps headerless blocks from a second region of the
+// same size, which `arena-reset` empties at once without touching the first one
+const uint64_t HEAP_SIZE = uint64_t(1) << 34;
+const int HEAP_CLASS_COUNT = 48;
+const int HEAP_MIN_CLASS = 4;
+const uint64_t HEAP_HEADER_SIZE = 16;
+const uint64_t ARENA_ALIGNMENT = 16;
+
+// `heap_state` layout: the region start, the bump pointer, the free lists, then the same two for the arena
+const int64_t HEAP_ARENA_OFFSET = (2 + HEAP_CLASS_COUNT) * 8;
+const int64_t HEAP_STATE_SIZE = HEAP_ARENA_OFFSET + 2 * 8;
+
+// Returns the start of a new region or 0
+uint64_t reserve_heap_region()
+{
+    void* region = mmap(nullptr, HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return region == MAP_FAILED ? 0 : uint64_t(region);
+}
+
+// Same allocator for the interpreter. The compiled one keeps this state in `heap_state`
+class Heap
+{
+public:
+    uint64_t Base = 0;
+    uint64_t Top = 0;
+    uint64_t FreeLists[HEAP_CLASS_COUNT] = {};
+    uint64_t ArenaBase = 0;
+    uint64_t ArenaTop = 0;
+
+    // Returns 0 when the size is too large or the memory is exhausted
+    uint64_t allocate(uint64_t size)
+    {
+        int size_class = HEAP_MIN_CLASS;
+        while ((uint64_t(1) << size_class) < size)
+        {
+            if (++size_class == HEAP_CLASS_COUNT) return 0;
+        }
+
+        if (FreeLists[size_class] != 0)
+        {
+            uint64_t block = FreeLists[size_class];
+            FreeLists[size_class] = *reinterpret_cast<uint64_t*>(block);
+            return block;
+        }
+
+        if (Top == 0)
+        {
+            Base = Top = reserve_heap_region();
+            if (Top == 0) return 0;
+        }
+
+        uint64_t end = Top + HEAP_HEADER_SIZE + (uint64_t(1) << size_class);
+        if (end > Base + HEAP_SIZE) return 0;
+
+        uint64_t block = Top;
+        *reinterpret_cast<uint64_t*>(block) = uint64_t(size_class);
+        Top = end;
+        return block + HEAP_HEADER_SIZE;
+    }
+
+    void release(uint64_t block)
+    {
+        if (block == 0) return;
+
+        uint64_t size_class = *reinterpret_cast<uint64_t*>(block - HEAP_HEADER_SIZE);
+        *reinterpret_cast<uint64_t*>(block) = FreeLists[size_class];
+        FreeLists[size_class] = block;
+    }
+
+    // Returns 0 when the size is too large or the arena is exhausted
+    uint64_t allocate_in_arena(uint64_t size)
+    {
+        uint64_t rounded = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        if (rounded < size) return 0;
+
+        if (ArenaTop == 0)
+        {
+            ArenaBase = ArenaTop = reserve_heap_region();
+            if (ArenaTop == 0) return 0;
+        }
+
+        if (rounded > ArenaBase + HEAP_SIZE - ArenaTop) return 0;
+
+        uint64_t block = ArenaTop;
+        ArenaTop += rounded;
+        return block;
+    }
+
+    void reset_arena()
+    {
+        if (ArenaBase == 0) return;
+
+        madvise(reinterpret_cast<void*>(ArenaBase), ArenaTop - ArenaBase, MADV_DONTNEED);
+        ArenaTop = ArenaBase;
+    }
+};
+
+// Instruction of the threaded code: `Handler` is the address of the interpreter code that runs it,
+// `Value` is the pushed constant or the index of the jump target
+class ThreadedInstruction
+{
+public:
+    const void* Handler;
+    uint64_t Value;
+};
+
+const size_t INTERPRETER_STACK_SIZE = 1024 * 1024;
+const size_t INTERPRETER_MEMORY_SIZE = 640000;
+
+// Prints the number to `stdout` the same way compiled `put`, `putd`, `print` and `printd` do
+void interpreter_print(uint64_t value, bool is_signed, bool newline)
+{
+    char buffer[24];
+    size_t size = format_number(value, is_signed, buffer);
+    if (newline) buffer[size++] = '\n';
+    ssize_t written = write(STDOUT_FILENO, buffer, size);
+    (void)written;
+}
+
+// -1, 0 or 1 like compiled `memcmp`, the C library only guarantees the sign
+uint64_t compare_memory(const void* a, const void* b, size_t size)
+{
+    int result = std::memcmp(a, b, size);
+    return uint64_t(int64_t(result > 0) - int64_t(result < 0));
+}
+
+// Offset of the first matching byte, or the size when there is none, like compiled `memchr`
+uint64_t find_byte(const char* data, int byte, size_t size)
+{
+    const void* found = std::memchr(data, byte, size);
+    return found ? uint64_t(static_cast<const char*>(found) - data) : uint64_t(size);
+}
+
+// Kernel's return value: negative error code on failure, as compiled programs see it
+uint64_t interpreter_syscall(uint64_t number, const uint64_t* arguments)
+{
+    long result = syscall(long(number), arguments[0], arguments[1], arguments[2], arguments[3], arguments[4], arguments[5]);
+    if (result == -1) return uint64_t(-int64_t(errno));
+    return uint64_t(result);
+}
+
+// Lowers operations to direct-threaded code and runs it. Strings and `mem` live in buffers of this
+// process and syscalls go straight to the kernel, so programs behave like compiled ones
+[[noreturn]] void interpret_program(const Program& program)
+{
+    assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling");
+
+    // Handlers are placed by operation type, so reordering `OpType` can't send operations to a wrong one.
+    // Constants are lowered to `PUSH_INT`, `ELSE` and backward `END` become jumps, `WHILE` and forward `END`
+    // produce no code, and `PROC` reached by falling through ends the program. Types without a handler are
+    // never lowered
+    const std::pair<OpType, const void*> handled[] = {
+            {OpType::PUSH_INT, &&push_int}, {OpType::PLUS, &&plus}, {OpType::MINUS, &&minus}, {OpType::MUL, &&mul},
+            {OpType::DIV, &&div}, {OpType::MOD, &&mod}, {OpType::DIVMOD, &&divmod}, {OpType::BOR, &&bor},
+            {OpType::BAND, &&band}, {OpType::XOR, &&bxor}, {OpType::SHL, &&shl}, {OpType::SHR, &&shr},
+            {OpType::EQ, &&eq}, {OpType::NE, &&ne}, {OpType::LT, &&lt}, {OpType::GT, &&gt}, {OpType::LE, &&le},
+            {OpType::GE, &&ge}, {OpType::NOT, &&bnot}, {OpType::IF, &&branch}, {OpType::ELSE, &&jump},
+            {OpType::END, &&jump}, {OpType::DO, &&branch}, {OpType::LOAD8, &&load8}, {OpType::STORE8, &&store8},
+            {OpType::LOAD16, &&load16}, {OpType::STORE16, &&store16}, {OpType::LOAD32, &&load32},
+            {OpType::STORE32, &&store32}, {OpType::LOAD64, &&load64}, {OpType::STORE64, &&store64},
+            {OpType::LOAD8S, &&load8s}, {OpType::LOAD16S, &&load16s}, {OpType::LOAD32S, &&load32s},
+            {OpType::ALLOC, &&alloc}, {OpType::FREE, &&free},
+            {OpType::ARENA_ALLOC, &&arena_alloc}, {OpType::ARENA_RESET, &&arena_reset},
+            {OpType::MEMCPY, &&memcpy}, {OpType::MEMSET, &&memset}, {OpType::MEMCMP, &&memcmp},
+            {OpType::STRLEN, &&strlen}, {OpType::MEMCHR, &&memchr}, {OpType::STREQ, &&streq}, {OpType::PUT, &&put},
+            {OpType::PUTD, &&putd}, {OpType::PRINT, &&print}, {OpType::PRINTD, &&printd}, {OpType::FMT, &&fmt},
+            {OpType::FMTD, &&fmtd}, {OpType::FPUTS, &&fputs}, {OpType::COPY, &&copy}, {OpType::OVER, &&over},
+            {OpType::SWAP, &&swap}, {OpType::SWAP2, &&swap2}, {OpType::DROP, &&drop}, {OpType::ROT, &&rot},
+            {OpType::SYSCALL0, &&syscall0}, {OpType::SYSCALL1, &&syscall1}, {OpType::SYSCALL2, &&syscall2},
+            {OpType::SYSCALL3, &&syscall3}, {OpType::SYSCALL4, &&syscall4}, {OpType::SYSCALL5, &&syscall5},
+            {OpType::SYSCALL6, &&syscall6}, {OpType::CALL, &&call}, {OpType::PROC, &&halt}, {OpType::RET, &&ret},
+    };
+
+    const void* handlers[static_cast<int>(OpType::COUNT)];
+    std::fill(std::begin(handlers), std::end(handlers), &&unreachable);
+    for (const auto& [type, handler] : handled)
+    {
+        assert(handlers[static_cast<int>(type)] == &&unreachable, "Operation with more than one interpreter handler");
+        handlers[static_cast<int>(type)] = handler;
+    }
+
+    std::string strings;
+    std::vector<size_t> string_offsets;
+    for (std::string_view s : program.Strings)
+    {
+        string_offsets.push_back(strings.size());
+        strings += s;
+    }
+
+    std::unique_ptr<uint8_t[]> memory = std::make_unique<uint8_t[]>(INTERPRETER_MEMORY_SIZE);
+    Heap heap;
+    std::unique_ptr<uint64_t[]> stack(new uint64_t[INTERPRETER_STACK_SIZE]);
+    std::unique_ptr<const ThreadedInstruction*[]> return_stack(new const ThreadedInstruction*[size_t(program.CallDepth) + 1]);
+
+    const std::vector<Operation>& ops = program.Ops;
+    std::vector<ThreadedInstruction> code;
+    std::vector<size_t> offsets(ops.size() + 1);
+    code.reserve(ops.size() + 1);
+
+    auto lower = [&code, &handlers](OpType type, uint64_t value) {
+        code.push_back({handlers[static_cast<int>(type)], value});
+    };
+
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        const Operation& op = ops[i];
+        offsets[i] = code.size();
+
+        switch (op.Type)
+        {
+            case OpType::PUSH_INT: lower(OpType::PUSH_INT, uint64_t(int64_t(op.IntegerValue))); break;
+            case OpType::TRUE: lower(OpType::PUSH_INT, 1); break;
+            case OpType::FALSE: lower(OpType::PUSH_INT, 0); break;
+            case OpType::MEM: lower(OpType::PUSH_INT, uint64_t(memory.get())); break;
+            case OpType::PUSH_STRING:
+            case OpType::HERE:
             {
-                complete_string(output_content, "    ; -- store8 --");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    mov     [rax], bl");
+                lower(OpType::PUSH_INT, program.Strings[op.StringId].size());
+                lower(OpType::PUSH_INT, uint64_t(strings.data() + string_offsets[op.StringId]));
                 break;
             }
-            case OpType::LOAD64:
+            case OpType::SYSCALL0:
+            case OpType::SYSCALL1:
+            case OpType::SYSCALL2:
+            case OpType::SYSCALL3:
+            case OpType::SYSCALL4:
+            case OpType::SYSCALL5:
+            case OpType::SYSCALL6:
             {
-                complete_string(output_content, "    ; -- load64 --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    xor     rbx, rbx");
-                complete_string(output_content, "    mov     rbx, [rax]");
-                complete_string(output_content, "    push    rbx");
+                lower(op.Type, uint64_t(static_cast<int>(op.Type) - static_cast<int>(OpType::SYSCALL0)));
                 break;
             }
-            case OpType::STORE64:
+            case OpType::WHILE: break;
+            case OpType::END:
+            {
+                if (op.JumpTo < int(i)) lower(OpType::END, uint64_t(op.JumpTo));
+                break;
+            }
+            case OpType::BIND:
+            case OpType::USE:
+            {
+                assert(false, "Unreachable. Bindings and `use` should be eliminated at the compilation step");
+            }
+            default: lower(op.Type, uint64_t(op.JumpTo)); break;
+        }
+    }
+
+    offsets[ops.size()] = code.size();
+    lower(OpType::PROC, 0);
+
+    // Targets are operation indices until now. Calls skip the `PROC` that ends the program when reached in order
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        switch (ops[i].Type)
+        {
+            case OpType::IF:
+            case OpType::DO:
+            case OpType::ELSE:
+                code[offsets[i]].Value = offsets[ops[i].JumpTo];
+                break;
+            case OpType::END:
+                if (ops[i].JumpTo < int(i)) code[offsets[i]].Value = offsets[ops[i].JumpTo];
+                break;
+            case OpType::CALL:
+                code[offsets[i]].Value = offsets[ops[i].JumpTo] + 1;
+                break;
+            default:
+                break;
+        }
+    }
+
+    const ThreadedInstruction* base = code.data();
+    const ThreadedInstruction* ip = base;
+    const ThreadedInstruction** rp = return_stack.get();
+    uint64_t* sp = stack.get();
+    uint64_t a, b, c, d;
+
+    cout.flush();
+    cerr.flush();
+
+#define NEXT() goto *(++ip)->Handler
+#define JUMP(target) do { ip = base + (target); goto *ip->Handler; } while (false)
+#define BINARY(expression) do { b = *--sp; a = sp[-1]; sp[-1] = (expression); NEXT(); } while (false)
+
+    goto *ip->Handler;
+
+push_int: *sp++ = ip->Value; NEXT();
+plus: BINARY(a + b);
+minus: BINARY(a - b);
+mul: BINARY(a * b);
+div: BINARY(a / b);
+mod: BINARY(a % b);
+divmod: a = sp[-2]; b = sp[-1]; sp[-2] = a / b; sp[-1] = a % b; NEXT();
+bor: BINARY(a | b);
+band: BINARY(a & b);
+bxor: BINARY(a ^ b);
+shl: BINARY(a << (b & 63));
+shr: BINARY(a >> (b & 63));
+eq: BINARY(a == b);
+ne: BINARY(a != b);
+lt: BINARY(int64_t(a) < int64_t(b));
+gt: BINARY(int64_t(a) > int64_t(b));
+le: BINARY(int64_t(a) <= int64_t(b));
+ge: BINARY(int64_t(a) >= int64_t(b));
+bnot: sp[-1] ^= 1; NEXT();
+branch: if (*--sp == 0) JUMP(ip->Value); NEXT();
+jump: JUMP(ip->Value);
+load8: sp[-1] = *reinterpret_cast<const uint8_t*>(sp[-1]); NEXT();
+store8: sp -= 2; *reinterpret_cast<uint8_t*>(sp[0]) = uint8_t(sp[1]); NEXT();
+load16: sp[-1] = *reinterpret_cast<const uint16_t*>(sp[-1]); NEXT();
+store16: sp -= 2; *reinterpret_cast<uint16_t*>(sp[0]) = uint16_t(sp[1]); NEXT();
+load32: sp[-1] = *reinterpret_cast<const uint32_t*>(sp[-1]); NEXT();
+store32: sp -= 2; *reinterpret_cast<uint32_t*>(sp[0]) = uint32_t(sp[1]); NEXT();
+load64: sp[-1] = *reinterpret_cast<const uint64_t*>(sp[-1]); NEXT();
+store64: sp -= 2; *reinterpret_cast<uint64_t*>(sp[0]) = sp[1]; NEXT();
+load8s: sp[-1] = uint64_t(int64_t(*reinterpret_cast<const int8_t*>(sp[-1]))); NEXT();
+load16s: sp[-1] = uint64_t(int64_t(*reinterpret_cast<const int16_t*>(sp[-1]))); NEXT();
+load32s: sp[-1] = uint64_t(int64_t(*reinterpret_cast<const int32_t*>(sp[-1]))); NEXT();
+alloc: sp[-1] = heap.allocate(sp[-1]); NEXT();
+free: heap.release(*--sp); NEXT();
+arena_alloc: sp[-1] = heap.allocate_in_arena(sp[-1]); NEXT();
+arena_reset: heap.reset_arena(); NEXT();
+memcpy: sp -= 3; std::memmove(reinterpret_cast<void*>(sp[0]), reinterpret_cast<const void*>(sp[1]), sp[2]); NEXT();
+memset: sp -= 3; std::memset(reinterpret_cast<void*>(sp[0]), int(sp[1]), sp[2]); NEXT();
+memcmp: sp -= 2; sp[-1] = compare_memory(reinterpret_cast<const void*>(sp[-1]), reinterpret_cast<const void*>(sp[0]), sp[1]); NEXT();
+strlen: sp[-1] = std::strlen(reinterpret_cast<const char*>(sp[-1])); NEXT();
+memchr: sp -= 2; sp[-1] = find_byte(reinterpret_cast<const char*>(sp[-1]), int(sp[0]), sp[1]); NEXT();
+streq: sp -= 3; sp[-1] = sp[-1] == sp[1] && std::memcmp(reinterpret_cast<const void*>(sp[0]), reinterpret_cast<const void*>(sp[2]), sp[1]) == 0; NEXT();
+put: interpreter_print(*--sp, false, true); NEXT();
+putd: interpreter_print(*--sp, true, true); NEXT();
+print: interpreter_print(*--sp, false, false); NEXT();
+printd: interpreter_print(*--sp, true, false); NEXT();
+fmt: --sp; sp[-1] = format_number(sp[0], false, reinterpret_cast<char*>(sp[-1])); NEXT();
+fmtd: --sp; sp[-1] = format_number(sp[0], true, reinterpret_cast<char*>(sp[-1])); NEXT();
+fputs:
+    {
+        sp -= 3;
+        ssize_t written = write(int(sp[2]), reinterpret_cast<const void*>(sp[1]), size_t(sp[0]));
+        (void)written;
+        NEXT();
+    }
+copy: *sp = sp[-1]; ++sp; NEXT();
+over: *sp = sp[-2]; ++sp; NEXT();
+swap: std::swap(sp[-1], sp[-2]); NEXT();
+swap2:
+    a = sp[-1]; b = sp[-2]; c = sp[-3]; d = sp[-4];
+    sp[-1] = c; sp[-2] = d; sp[-3] = a; sp[-4] = b;
+    NEXT();
+drop: --sp; NEXT();
+rot:
+    a = sp[-1]; b = sp[-2]; c = sp[-3];
+    sp[-1] = b; sp[-2] = c; sp[-3] = a;
+    NEXT();
+syscall0:
+syscall1:
+syscall2:
+syscall3:
+syscall4:
+syscall5:
+syscall6:
+    {
+        // Arguments follow the syscall number from the top of the stack down
+        uint64_t arguments[6] = {};
+        int count = int(ip->Value);
+        uint64_t number = *--sp;
+        for (int k = 0; k < count; ++k) arguments[k] = *--sp;
+        *sp++ = interpreter_syscall(number, arguments);
+        NEXT();
+    }
+call: *rp++ = ip; JUMP(ip->Value);
+ret: ip = *--rp; NEXT();
+halt: exit(0);
+unreachable: assert(false, "Unreachable. Operation should have been lowered");
+
+#undef BINARY
+#undef JUMP
+#undef NEXT
+
+    exit(1);
+}
+
+// Registers in the order of their x86-64 encoding
+enum class Reg : uint8_t
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    COUNT
+};
+
+// Register names by operand size: 1, 2, 4 and 8 bytes
+const char* RegisterNames[4][static_cast<int>(Reg::COUNT)] = {
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+};
+
+const char* SizeNames[4] = {"BYTE", "WORD", "DWORD", "QWORD"};
+
+int size_index(uint8_t size)
+{
+    return size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3;
+}
+
+// Condition codes in the order of their x86-64 encoding, so flipping the lowest bit negates a condition
+enum class Cond : uint8_t
+{
+    O, NO, B, AE, E, NE, BE, A, S, NS, P, NP, L, GE, LE, G,
+    COUNT
+};
+
+const char* ConditionNames[static_cast<int>(Cond::COUNT)] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"
+};
+
+enum class Mnemonic : uint8_t
+{
+    MOV,
+    MOVZX,
+    MOVSX,
+    LEA,
+    PUSH,
+    POP,
+    ADD,
+    SUB,
+    INC,
+    IMUL,
+    MUL,
+    DIV,
+    AND,
+    OR,
+    XOR,
+    SHL,
+    SHR,
+    CMP,
+    TEST,
+    JMP,
+    JCC,
+    CALL,
+    RET,
+    SYSCALL,
+    SETCC,
+    CMOVCC,
+    BSF,
+    REP_MOVSB,
+    REP_STOSB,
+    LABEL,
+    COMMENT,
+    COUNT
+};
+
+// Conditional instructions get their condition appended to the name
+const char* MnemonicNames[static_cast<int>(Mnemonic::COUNT)] = {
+    "mov", "movzx", "movsx", "lea", "push", "pop", "add", "sub", "inc", "imul", "mul", "div", "and", "or", "xor",
+    "shl", "shr", "cmp", "test", "jmp", "j", "call", "ret", "syscall", "set", "cmov", "bsf",
+    "rep movsb", "rep stosb", "", ""
+};
+
+enum class OperandKind : uint8_t
+{
+    NONE,
+    REG,
+    IMM,
+    MEM,
+    COUNT
+};
+
+// Immediates and memory displacements are relative to `Label` when it is set
+class Operand
+{
+public:
+    OperandKind Kind = OperandKind::NONE;
+    uint8_t Size = 8;
+    Reg Base = Reg::COUNT;
+    Reg Index = Reg::COUNT;
+    uint8_t Scale = 1;
+    int Label = -1;
+    int64_t Value = 0;
+};
+
+Operand reg(Reg r, uint8_t size = 8)
+{
+    return {OperandKind::REG, size, r};
+}
+
+Operand imm(int64_t value)
+{
+    return {OperandKind::IMM, 8, Reg::COUNT, Reg::COUNT, 1, -1, value};
+}
+
+Operand label(int id, int64_t offset = 0)
+{
+    return {OperandKind::IMM, 8, Reg::COUNT, Reg::COUNT, 1, id, offset};
+}
+
+Operand mem(Reg base, int64_t displacement = 0, uint8_t size = 8)
+{
+    return {OperandKind::MEM, size, base, Reg::COUNT, 1, -1, displacement};
+}
+
+Operand mem(Reg base, Reg index, uint8_t scale, int64_t displacement = 0, uint8_t size = 8)
+{
+    return {OperandKind::MEM, size, base, index, scale, -1, displacement};
+}
+
+bool uses_register(const Operand& operand, Reg r)
+{
+    if (operand.Kind == OperandKind::REG) return operand.Base == r;
+    if (operand.Kind == OperandKind::MEM) return operand.Base == r || operand.Index == r;
+    return false;
+}
+
+bool is_register(const Operand& operand, Reg r)
+{
+    return operand.Kind == OperandKind::REG && operand.Base == r;
+}
+
+bool is_immediate(const Operand& operand, int64_t value)
+{
+    return operand.Kind == OperandKind::IMM && operand.Label < 0 && operand.Value == value;
+}
+
+// Label addresses are linked below 2GiB, so they are valid sign-extended immediates too
+bool fits_imm32(const Operand& operand)
+{
+    return operand.Kind == OperandKind::IMM && (operand.Label >= 0 || (operand.Value >= INT32_MIN && operand.Value <= INT32_MAX));
+}
+
+// `LABEL` binds the label in `Dst`, `COMMENT` refers to the operation index in `Dst`
+class Instruction
+{
+public:
+    Mnemonic Op;
+    Cond Condition = Cond::COUNT;
+    Operand Dst;
+    Operand Src;
+};
+
+class DataBlock
+{
+public:
+    int Label;
+    std::string_view Bytes;
+};
+
+class BssBlock
+{
+public:
+    int Label;
+    size_t Size;
+};
+
+// Instruction stream of a whole program. Labels are numbered: operation addresses come first,
+// then one label per interned string, then named labels of the runtime
+class Assembler
+{
+public:
+    std::vector<Instruction> Code;
+    std::vector<DataBlock> Data;
+    std::vector<BssBlock> Bss;
+    std::vector<const char*> Names;
+    int OpLabels;
+    int StringLabels;
+    // Operation labels reached with the top of the stack in a register instead of spilled
+    std::unordered_map<int, Reg> CarriedRegisters;
+
+    Assembler(size_t op_count, size_t string_count) : OpLabels(int(op_count) + 1), StringLabels(int(string_count)) {}
+
+    int string_label(int id) const { return OpLabels + id; }
+    bool is_op_label(int id) const { return id < OpLabels; }
+
+    bool is_carried(int id, Reg r) const
+    {
+        auto it = CarriedRegisters.find(id);
+        return it != CarriedRegisters.end() && it->second == r;
+    }
+
+    int named_label(const char* name)
+    {
+        Names.push_back(name);
+        return OpLabels + StringLabels + int(Names.size()) - 1;
+    }
+
+    void emit(Mnemonic op, Operand dst = {}, Operand src = {})
+    {
+        Code.push_back({op, Cond::COUNT, dst, src});
+    }
+
+    void emit(Mnemonic op, Cond condition, Operand dst, Operand src = {})
+    {
+        Code.push_back({op, condition, dst, src});
+    }
+
+    void bind(int id)
+    {
+        emit(Mnemonic::LABEL, label(id));
+    }
+};
+
+void emit_exit(Assembler& a)
+{
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(60));
+    a.emit(Mnemonic::MOV, reg(Reg::RDI), imm(0));
+    a.emit(Mnemonic::SYSCALL);
+}
+
+// Arguments of `syscall0`..`syscall6` after the syscall number
+const Reg SyscallRegisters[] = {Reg::RDI, Reg::RSI, Reg::RDX, Reg::R10, Reg::R8, Reg::R9};
+
+// How `put` and `fputs` reach the kernel: collected in a buffer that is written out when it is full,
+// before syscalls and on exit, additionally after every written newline, or written right away
+enum class OutputBuffering : uint8_t
+{
+    FULL,
+    LINE,
+    NONE,
+    COUNT
+};
+
+const int64_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+
+// `put`, `putd`, `print`, `printd`, `fmt` and `fmtd`
+const int NUMBER_ROUTINE_COUNT = 6;
+
+
+// Runtime labels and data shared by the code of all operations
+// `memcpy`, `memset`, `memcmp`, `strlen`, `memchr` and `streq`, in the order of their operations
+const int MEMORY_ROUTINE_COUNT = 6;
+
+// Below this size `rep movsb` and `rep stosb` spend more time starting up than copying
+const int64_t REP_STRING_THRESHOLD = 128;
+
+int memory_routine(OpType type)
+{
+    assert(type >= OpType::MEMCPY && type <= OpType::STREQ, "Not a memory operation");
+    return static_cast<int>(type) - static_cast<int>(OpType::MEMCPY);
+}
+
+class Runtime
+{
+public:
+    int Memory;
+    int ReturnStack;
+    int WriteOutput;
+    int FlushOutput;
+    int Output;
+    int OutputState;
+    int Alloc;
+    int Free;
+    int ArenaAlloc;
+    int ArenaReset;
+    int HeapState;
+    bool IsHeapNeeded = false;
+    int MemoryRoutines[MEMORY_ROUTINE_COUNT];
+    bool UsedMemoryRoutines[MEMORY_ROUTINE_COUNT] = {};
+    int FormatDigits;
+    int FormatCopy;
+    int DigitPairs;
+    int Numbers[NUMBER_ROUTINE_COUNT];
+    bool UsedNumbers[NUMBER_ROUTINE_COUNT] = {};
+    // Set when the program writes anything and buffering isn't turned off
+    bool IsOutputBuffered = false;
+    OutputBuffering Buffering = OutputBuffering::NONE;
+    std::vector<bool> UsedStrings;
+};
+
+// `write_output` takes the arguments of the `write` syscall and appends the bytes to the output buffer.
+// The buffer holds bytes of one descriptor at a time and is flushed before taking another one, so the
+// order of writes is kept. `flush_output` keeps `rdi`, `rsi` and `rdx`
+void emit_output_buffer(Assembler& a, const Runtime& runtime)
+{
+    int take = a.named_label("write_output_take");
+    int flush_first = a.named_label("write_output_flush");
+    int copy = a.named_label("write_output_copy");
+    int copy_byte = a.named_label("write_output_byte");
+    int copied = a.named_label("write_output_copied");
+    int flushed = a.named_label("flush_output_done");
+    bool line_buffered = runtime.Buffering == OutputBuffering::LINE;
+
+    // `output_state` holds the number of buffered bytes and their descriptor
+    a.bind(runtime.WriteOutput);
+    a.emit(Mnemonic::MOV, reg(Reg::R9), label(runtime.OutputState));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), mem(Reg::R9));
+    a.emit(Mnemonic::TEST, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::JCC, Cond::E, label(take));
+    a.emit(Mnemonic::CMP, reg(Reg::RDI), mem(Reg::R9, 8));
+    a.emit(Mnemonic::JCC, Cond::NE, label(flush_first));
+    a.emit(Mnemonic::LEA, reg(Reg::RCX), mem(Reg::RAX, Reg::RDX, 1));
+    a.emit(Mnemonic::CMP, reg(Reg::RCX), imm(OUTPUT_BUFFER_SIZE));
+    a.emit(Mnemonic::JCC, Cond::BE, label(copy));
+    a.bind(flush_first);
+    a.emit(Mnemonic::CALL, label(runtime.FlushOutput));
+    a.emit(Mnemonic::XOR, reg(Reg::RAX), reg(Reg::RAX));
+    a.bind(take);
+    a.emit(Mnemonic::MOV, mem(Reg::R9, 8), reg(Reg::RDI));
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), imm(OUTPUT_BUFFER_SIZE));
+    a.emit(Mnemonic::JCC, Cond::BE, label(copy));
+    // Doesn't fit even into the empty buffer
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(1));
+    a.emit(Mnemonic::SYSCALL);
+    a.emit(Mnemonic::RET);
+
+    a.bind(copy);
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), label(runtime.Output));
+    a.emit(Mnemonic::ADD, reg(Reg::RCX), reg(Reg::RAX));
+    a.emit(Mnemonic::ADD, reg(Reg::RAX), reg(Reg::RDX));
+    a.emit(Mnemonic::MOV, mem(Reg::R9), reg(Reg::RAX));
+    a.emit(Mnemonic::XOR, reg(Reg::R8), reg(Reg::R8));
+    if (line_buffered) a.emit(Mnemonic::XOR, reg(Reg::R11), reg(Reg::R11));
+    a.bind(copy_byte);
+    a.emit(Mnemonic::CMP, reg(Reg::R8), reg(Reg::RDX));
+    a.emit(Mnemonic::JCC, Cond::AE, label(copied));
+    a.emit(Mnemonic::MOV, reg(Reg::R10, 1), mem(Reg::RSI, Reg::R8, 1, 0, 1));
+    a.emit(Mnemonic::MOV, mem(Reg::RCX, Reg::R8, 1, 0, 1), reg(Reg::R10, 1));
+    if (line_buffered)
+    {
+        // `r11b` is set once a newline is copied
+        a.emit(Mnemonic::CMP, reg(Reg::R10, 1), imm(10));
+        a.emit(Mnemonic::SETCC, Cond::E, reg(Reg::RAX, 1));
+        a.emit(Mnemonic::OR, reg(Reg::R11, 1), reg(Reg::RAX, 1));
+    }
+    a.emit(Mnemonic::ADD, reg(Reg::R8), imm(1));
+    a.emit(Mnemonic::JMP, label(copy_byte));
+    a.bind(copied);
+    if (line_buffered)
+    {
+        a.emit(Mnemonic::TEST, reg(Reg::R11, 1), reg(Reg::R11, 1));
+        a.emit(Mnemonic::JCC, Cond::NE, label(runtime.FlushOutput));
+    }
+    a.emit(Mnemonic::RET);
+
+    a.bind(runtime.FlushOutput);
+    a.emit(Mnemonic::PUSH, reg(Reg::RDI));
+    a.emit(Mnemonic::PUSH, reg(Reg::RSI));
+    a.emit(Mnemonic::PUSH, reg(Reg::RDX));
+    a.emit(Mnemonic::MOV, reg(Reg::R9), label(runtime.OutputState));
+    a.emit(Mnemonic::MOV, reg(Reg::RDX), mem(Reg::R9));
+    a.emit(Mnemonic::TEST, reg(Reg::RDX), reg(Reg::RDX));
+    a.emit(Mnemonic::JCC, Cond::E, label(flushed));
+    a.emit(Mnemonic::MOV, reg(Reg::RDI), mem(Reg::R9, 8));
+    a.emit(Mnemonic::MOV, reg(Reg::RSI), label(runtime.Output));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(1));
+    a.emit(Mnemonic::SYSCALL);
+    a.emit(Mnemonic::MOV, mem(Reg::R9), imm(0));
+    a.bind(flushed);
+    a.emit(Mnemonic::POP, reg(Reg::RDX));
+    a.emit(Mnemonic::POP, reg(Reg::RSI));
+    a.emit(Mnemonic::POP, reg(Reg::RDI));
+    a.emit(Mnemonic::RET);
+}
+
+// `alloc` and `arena-alloc` take the size in `rdi` and return the block or 0 in `rax`, `free` takes the
+// block in `rdi`. `heap_state` holds both regions and the free lists, see `Heap`. Only registers that
+// syscalls may clobber anyway are used, so cached stack values and `r15` survive
+void emit_heap(Assembler& a, const Runtime& runtime)
+{
+    int reserve = a.named_label("heap_reserve");
+    int find_class = a.named_label("alloc_class");
+    int classified = a.named_label("alloc_classified");
+    int bump = a.named_label("alloc_bump");
+    int reserved = a.named_label("alloc_reserved");
+    int failed = a.named_label("alloc_failed");
+    int freed = a.named_label("free_done");
+    int arena_reserved = a.named_label("arena_alloc_reserved");
+    int reset = a.named_label("arena_reset_done");
+    auto free_list = [](Reg size_class) { return mem(Reg::R11, size_class, 8, 2 * 8); };
+
+    // Maps a new region into `rax`, or an error as -4095..-1. Keeps `rcx`, `rdx` and `rdi`, points `r11`
+    // to `heap_state` again
+    a.bind(reserve);
+    a.emit(Mnemonic::PUSH, reg(Reg::RCX));
+    a.emit(Mnemonic::PUSH, reg(Reg::RDX));
+    a.emit(Mnemonic::PUSH, reg(Reg::RDI));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(9));
+    a.emit(Mnemonic::XOR, reg(Reg::RDI), reg(Reg::RDI));
+    a.emit(Mnemonic::MOV, reg(Reg::RSI), imm(int64_t(HEAP_SIZE)));
+    a.emit(Mnemonic::MOV, reg(Reg::RDX), imm(PROT_READ | PROT_WRITE));
+    a.emit(Mnemonic::MOV, reg(Reg::R10), imm(MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE));
+    a.emit(Mnemonic::MOV, reg(Reg::R8), imm(-1));
+    a.emit(Mnemonic::XOR, reg(Reg::R9), reg(Reg::R9));
+    a.emit(Mnemonic::SYSCALL);
+    a.emit(Mnemonic::POP, reg(Reg::RDI));
+    a.emit(Mnemonic::POP, reg(Reg::RDX));
+    a.emit(Mnemonic::POP, reg(Reg::RCX));
+    a.emit(Mnemonic::MOV, reg(Reg::R11), label(runtime.HeapState));
+    a.emit(Mnemonic::RET);
+
+    a.bind(runtime.Alloc);
+    a.emit(Mnemonic::MOV, reg(Reg::R11), label(runtime.HeapState));
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), imm(HEAP_MIN_CLASS));
+    a.emit(Mnemonic::MOV, reg(Reg::RDX), imm(int64_t(1) << HEAP_MIN_CLASS));
+    a.bind(find_class);
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), reg(Reg::RDI));
+    a.emit(Mnemonic::JCC, Cond::AE, label(classified));
+    a.emit(Mnemonic::SHL, reg(Reg::RDX), imm(1));
+    a.emit(Mnemonic::ADD, reg(Reg::RCX), imm(1));
+    a.emit(Mnemonic::CMP, reg(Reg::RCX), imm(HEAP_CLASS_COUNT));
+    a.emit(Mnemonic::JCC, Cond::B, label(find_class));
+    a.emit(Mnemonic::JMP, label(failed));
+    a.bind(classified);
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), free_list(Reg::RCX));
+    a.emit(Mnemonic::TEST, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::JCC, Cond::E, label(bump));
+    a.emit(Mnemonic::MOV, reg(Reg::R8), mem(Reg::RAX));
+    a.emit(Mnemonic::MOV, free_list(Reg::RCX), reg(Reg::R8));
+    a.emit(Mnemonic::RET);
+    a.bind(bump);
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), mem(Reg::R11, 8));
+    a.emit(Mnemonic::TEST, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::JCC, Cond::NE, label(reserved));
+    // The region is reserved on the first allocation
+    a.emit(Mnemonic::CALL, label(reserve));
+    a.emit(Mnemonic::CMP, reg(Reg::RAX), imm(-4096));
+    a.emit(Mnemonic::JCC, Cond::A, label(failed));
+    a.emit(Mnemonic::MOV, mem(Reg::R11), reg(Reg::RAX));
+    a.bind(reserved);
+    a.emit(Mnemonic::LEA, reg(Reg::R8), mem(Reg::RAX, Reg::RDX, 1, HEAP_HEADER_SIZE));
+    a.emit(Mnemonic::MOV, reg(Reg::R9), imm(int64_t(HEAP_SIZE)));
+    a.emit(Mnemonic::ADD, reg(Reg::R9), mem(Reg::R11));
+    a.emit(Mnemonic::CMP, reg(Reg::R8), reg(Reg::R9));
+    a.emit(Mnemonic::JCC, Cond::A, label(failed));
+    a.emit(Mnemonic::MOV, mem(Reg::R11, 8), reg(Reg::R8));
+    a.emit(Mnemonic::MOV, mem(Reg::RAX), reg(Reg::RCX));
+    a.emit(Mnemonic::ADD, reg(Reg::RAX), imm(HEAP_HEADER_SIZE));
+    a.emit(Mnemonic::RET);
+    a.bind(failed);
+    a.emit(Mnemonic::XOR, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::RET);
+
+    a.bind(runtime.Free);
+    a.emit(Mnemonic::TEST, reg(Reg::RDI), reg(Reg::RDI));
+    a.emit(Mnemonic::JCC, Cond::E, label(freed));
+    a.emit(Mnemonic::MOV, reg(Reg::R11), label(runtime.HeapState));
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), mem(Reg::RDI, -int64_t(HEAP_HEADER_SIZE)));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), free_list(Reg::RCX));
+    a.emit(Mnemonic::MOV, mem(Reg::RDI), reg(Reg::RAX));
+    a.emit(Mnemonic::MOV, free_list(Reg::RCX), reg(Reg::RDI));
+    a.bind(freed);
+    a.emit(Mnemonic::RET);
+
+    // The size is rounded up in `rdx`, a size that wraps around fails
+    a.bind(runtime.ArenaAlloc);
+    a.emit(Mnemonic::MOV, reg(Reg::R11), label(runtime.HeapState));
+    a.emit(Mnemonic::LEA, reg(Reg::RDX), mem(Reg::RDI, int64_t(ARENA_ALIGNMENT - 1)));
+    a.emit(Mnemonic::AND, reg(Reg::RDX), imm(-int64_t(ARENA_ALIGNMENT)));
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), reg(Reg::RDI));
+    a.emit(Mnemonic::JCC, Cond::B, label(failed));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), mem(Reg::R11, HEAP_ARENA_OFFSET + 8));
+    a.emit(Mnemonic::TEST, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::JCC, Cond::NE, label(arena_reserved));
+    a.emit(Mnemonic::CALL, label(reserve));
+    a.emit(Mnemonic::CMP, reg(Reg::RAX), imm(-4096));
+    a.emit(Mnemonic::JCC, Cond::A, label(failed));
+    a.emit(Mnemonic::MOV, mem(Reg::R11, HEAP_ARENA_OFFSET), reg(Reg::RAX));
+    a.bind(arena_reserved);
+    a.emit(Mnemonic::MOV, reg(Reg::R8), imm(int64_t(HEAP_SIZE)));
+    a.emit(Mnemonic::ADD, reg(Reg::R8), mem(Reg::R11, HEAP_ARENA_OFFSET));
+    a.emit(Mnemonic::SUB, reg(Reg::R8), reg(Reg::RAX));
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), reg(Reg::R8));
+    a.emit(Mnemonic::JCC, Cond::A, label(failed));
+    a.emit(Mnemonic::ADD, reg(Reg::RDX), reg(Reg::RAX));
+    a.emit(Mnemonic::MOV, mem(Reg::R11, HEAP_ARENA_OFFSET + 8), reg(Reg::RDX));
+    a.emit(Mnemonic::RET);
+
+    a.bind(runtime.ArenaReset);
+    a.emit(Mnemonic::MOV, reg(Reg::R11), label(runtime.HeapState));
+    a.emit(Mnemonic::MOV, reg(Reg::RDI), mem(Reg::R11, HEAP_ARENA_OFFSET));
+    a.emit(Mnemonic::TEST, reg(Reg::RDI), reg(Reg::RDI));
+    a.emit(Mnemonic::JCC, Cond::E, label(reset));
+    a.emit(Mnemonic::MOV, reg(Reg::RSI), mem(Reg::R11, HEAP_ARENA_OFFSET + 8));
+    a.emit(Mnemonic::SUB, reg(Reg::RSI), reg(Reg::RDI));
+    a.emit(Mnemonic::MOV, mem(Reg::R11, HEAP_ARENA_OFFSET + 8), reg(Reg::RDI));
+    a.emit(Mnemonic::MOV, reg(Reg::RDX), imm(MADV_DONTNEED));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(28));
+    a.emit(Mnemonic::SYSCALL);
+    a.bind(reset);
+    a.emit(Mnemonic::RET);
+}
+
+// Memory routines take the destination or the first block in `rdi`, the source or the byte value in
+// `rsi` and the size in `rdx`. Big blocks go through `rep movsb` and `rep stosb`, which are fast with
+// ERMS on every x86-64 we target, small ones through 8-byte moves and a byte tail
+void emit_memory_transfer(Assembler& a, const Runtime& runtime, bool is_copy)
+{
+    int small = a.named_label(is_copy ? "memcpy_small" : "memset_small");
+    int qwords = a.named_label(is_copy ? "memcpy_qwords" : "memset_qwords");
+    int tail = a.named_label(is_copy ? "memcpy_tail" : "memset_tail");
+    int byte = a.named_label(is_copy ? "memcpy_byte" : "memset_byte");
+    int done = a.named_label(is_copy ? "memcpy_done" : "memset_done");
+
+    a.bind(runtime.MemoryRoutines[memory_routine(is_copy ? OpType::MEMCPY : OpType::MEMSET)]);
+    if (!is_copy)
+    {
+        a.emit(Mnemonic::MOVZX, reg(Reg::RAX, 4), reg(Reg::RSI, 1));
+    }
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), reg(Reg::RDX));
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), imm(REP_STRING_THRESHOLD));
+    a.emit(Mnemonic::JCC, Cond::B, label(small));
+    a.emit(is_copy ? Mnemonic::REP_MOVSB : Mnemonic::REP_STOSB);
+    a.emit(Mnemonic::RET);
+    a.bind(small);
+    if (!is_copy)
+    {
+        // The byte repeated in every byte of `rax`
+        a.emit(Mnemonic::MOV, reg(Reg::R8), imm(0x0101010101010101));
+        a.emit(Mnemonic::IMUL, reg(Reg::RAX), reg(Reg::R8));
+    }
+    a.bind(qwords);
+    a.emit(Mnemonic::CMP, reg(Reg::RCX), imm(8));
+    a.emit(Mnemonic::JCC, Cond::B, label(tail));
+    if (is_copy) a.emit(Mnemonic::MOV, reg(Reg::RAX), mem(Reg::RSI));
+    a.emit(Mnemonic::MOV, mem(Reg::RDI), reg(Reg::RAX));
+    if (is_copy) a.emit(Mnemonic::ADD, reg(Reg::RSI), imm(8));
+    a.emit(Mnemonic::ADD, reg(Reg::RDI), imm(8));
+    a.emit(Mnemonic::SUB, reg(Reg::RCX), imm(8));
+    a.emit(Mnemonic::JMP, label(qwords));
+    a.bind(tail);
+    a.emit(Mnemonic::TEST, reg(Reg::RCX), reg(Reg::RCX));
+    a.emit(Mnemonic::JCC, Cond::E, label(done));
+    a.bind(byte);
+    if (is_copy) a.emit(Mnemonic::MOV, reg(Reg::RAX, 1), mem(Reg::RSI, 0, 1));
+    a.emit(Mnemonic::MOV, mem(Reg::RDI, 0, 1), reg(Reg::RAX, 1));
+    if (is_copy) a.emit(Mnemonic::ADD, reg(Reg::RSI), imm(1));
+    a.emit(Mnemonic::ADD, reg(Reg::RDI), imm(1));
+    a.emit(Mnemonic::SUB, reg(Reg::RCX), imm(1));
+    a.emit(Mnemonic::JCC, Cond::NE, label(byte));
+    a.bind(done);
+    a.emit(Mnemonic::RET);
+}
+
+// `memcmp` returns -1, 0 or 1 in `rax`. The first differing 8 bytes are compared again byte by byte
+// to get the order
+void emit_memory_compare(Assembler& a, const Runtime& runtime)
+{
+    int qwords = a.named_label("memcmp_qwords");
+    int byte = a.named_label("memcmp_byte");
+    int differ = a.named_label("memcmp_differ");
+    int done = a.named_label("memcmp_done");
+
+    a.bind(runtime.MemoryRoutines[memory_routine(OpType::MEMCMP)]);
+    a.bind(qwords);
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), imm(8));
+    a.emit(Mnemonic::JCC, Cond::B, label(byte));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), mem(Reg::RDI));
+    a.emit(Mnemonic::CMP, reg(Reg::RAX), mem(Reg::RSI));
+    a.emit(Mnemonic::JCC, Cond::NE, label(byte));
+    a.emit(Mnemonic::ADD, reg(Reg::RDI), imm(8));
+    a.emit(Mnemonic::ADD, reg(Reg::RSI), imm(8));
+    a.emit(Mnemonic::SUB, reg(Reg::RDX), imm(8));
+    a.emit(Mnemonic::JMP, label(qwords));
+    a.bind(byte);
+    a.emit(Mnemonic::TEST, reg(Reg::RDX), reg(Reg::RDX));
+    a.emit(Mnemonic::JCC, Cond::E, label(done));
+    a.emit(Mnemonic::MOVZX, reg(Reg::RAX, 4), mem(Reg::RDI, 0, 1));
+    a.emit(Mnemonic::MOVZX, reg(Reg::RCX, 4), mem(Reg::RSI, 0, 1));
+    a.emit(Mnemonic::CMP, reg(Reg::RAX), reg(Reg::RCX));
+    a.emit(Mnemonic::JCC, Cond::NE, label(differ));
+    a.emit(Mnemonic::ADD, reg(Reg::RDI), imm(1));
+    a.emit(Mnemonic::ADD, reg(Reg::RSI), imm(1));
+    a.emit(Mnemonic::SUB, reg(Reg::RDX), imm(1));
+    a.emit(Mnemonic::JMP, label(byte));
+    a.bind(differ);
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(-1));
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), imm(1));
+    a.emit(Mnemonic::CMOVCC, Cond::A, reg(Reg::RAX), reg(Reg::RCX));
+    a.emit(Mnemonic::RET);
+    a.bind(done);
+    a.emit(Mnemonic::XOR, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::RET);
+}
+
+// Sets a bit in `result` for each zero byte of `value` up to the first one, so `bsf` finds it. Bytes
+// after the first zero may be marked too. `r9` and `r10` hold 0x01 and 0x80 repeated in every byte
+void emit_zero_bytes(Assembler& a, Reg value, Reg result)
+{
+    a.emit(Mnemonic::MOV, reg(result), reg(value));
+    a.emit(Mnemonic::SUB, reg(result), reg(Reg::R9));
+    a.emit(Mnemonic::XOR, reg(value), imm(-1));
+    a.emit(Mnemonic::AND, reg(result), reg(value));
+    a.emit(Mnemonic::AND, reg(result), reg(Reg::R10));
+}
+
+void emit_byte_masks(Assembler& a)
+{
+    a.emit(Mnemonic::MOV, reg(Reg::R9), imm(0x0101010101010101));
+    a.emit(Mnemonic::MOV, reg(Reg::R10), imm(int64_t(0x8080808080808080)));
+}
+
+// `strlen` takes the string in `rdi`, `memchr` the block in `rdi`, the byte in `rsi` and the size in `rdx`.
+// Both return the offset in `rax`, `memchr` returns the size when the byte isn't there. Bytes are checked
+// one by one up to an 8-byte boundary, then 8 at a time. Aligned loads never cross a page, so `strlen`
+// can't fault on the bytes past the end
+void emit_byte_search(Assembler& a, const Runtime& runtime, bool is_bounded)
+{
+    int head = a.named_label(is_bounded ? "memchr_head" : "strlen_head");
+    int qwords = a.named_label(is_bounded ? "memchr_qwords" : "strlen_qwords");
+    int hit = a.named_label(is_bounded ? "memchr_hit" : "strlen_hit");
+    int found = a.named_label(is_bounded ? "memchr_found" : "strlen_found");
+
+    a.bind(runtime.MemoryRoutines[memory_routine(is_bounded ? OpType::MEMCHR : OpType::STRLEN)]);
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), reg(Reg::RDI));
+    if (is_bounded)
+    {
+        a.emit(Mnemonic::MOVZX, reg(Reg::RSI, 4), reg(Reg::RSI, 1));
+        a.emit(Mnemonic::LEA, reg(Reg::R11), mem(Reg::RDI, Reg::RDX, 1));
+    }
+
+    int missing = is_bounded ? a.named_label("memchr_missing") : -1;
+    int tail = is_bounded ? a.named_label("memchr_tail") : -1;
+    auto emit_byte_check = [&]() {
+        if (is_bounded)
+        {
+            a.emit(Mnemonic::CMP, reg(Reg::RAX), reg(Reg::R11));
+            a.emit(Mnemonic::JCC, Cond::AE, label(missing));
+        }
+        a.emit(Mnemonic::MOVZX, reg(Reg::RCX, 4), mem(Reg::RAX, 0, 1));
+        if (is_bounded) a.emit(Mnemonic::CMP, reg(Reg::RCX), reg(Reg::RSI));
+        else a.emit(Mnemonic::TEST, reg(Reg::RCX), reg(Reg::RCX));
+        a.emit(Mnemonic::JCC, Cond::E, label(found));
+        a.emit(Mnemonic::ADD, reg(Reg::RAX), imm(1));
+    };
+
+    int aligned = a.named_label(is_bounded ? "memchr_aligned" : "strlen_aligned");
+    a.bind(head);
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), reg(Reg::RAX));
+    a.emit(Mnemonic::AND, reg(Reg::RCX), imm(7));
+    a.emit(Mnemonic::JCC, Cond::E, label(aligned));
+    emit_byte_check();
+    a.emit(Mnemonic::JMP, label(head));
+
+    a.bind(aligned);
+    emit_byte_masks(a);
+    if (is_bounded)
+    {
+        // XOR with the byte repeated 8 times turns matching bytes into zeros
+        a.emit(Mnemonic::MOV, reg(Reg::R8), reg(Reg::RSI));
+        a.emit(Mnemonic::IMUL, reg(Reg::R8), reg(Reg::R9));
+    }
+    a.bind(qwords);
+    if (is_bounded)
+    {
+        a.emit(Mnemonic::LEA, reg(Reg::RCX), mem(Reg::RAX, 8));
+        a.emit(Mnemonic::CMP, reg(Reg::RCX), reg(Reg::R11));
+        a.emit(Mnemonic::JCC, Cond::A, label(tail));
+    }
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), mem(Reg::RAX));
+    if (is_bounded) a.emit(Mnemonic::XOR, reg(Reg::RCX), reg(Reg::R8));
+    emit_zero_bytes(a, Reg::RCX, Reg::RDX);
+    a.emit(Mnemonic::JCC, Cond::NE, label(hit));
+    a.emit(Mnemonic::ADD, reg(Reg::RAX), imm(8));
+    a.emit(Mnemonic::JMP, label(qwords));
+
+    a.bind(hit);
+    a.emit(Mnemonic::BSF, reg(Reg::RDX), reg(Reg::RDX));
+    a.emit(Mnemonic::SHR, reg(Reg::RDX), imm(3));
+    a.emit(Mnemonic::ADD, reg(Reg::RAX), reg(Reg::RDX));
+    if (is_bounded)
+    {
+        a.emit(Mnemonic::JMP, label(found));
+        a.bind(tail);
+        emit_byte_check();
+        a.emit(Mnemonic::JMP, label(tail));
+        a.bind(missing);
+        a.emit(Mnemonic::MOV, reg(Reg::RAX), reg(Reg::R11));
+    }
+    a.bind(found);
+    a.emit(Mnemonic::SUB, reg(Reg::RAX), reg(Reg::RDI));
+    a.emit(Mnemonic::RET);
+}
+
+// `streq` takes the strings as `rdi` and `rsi` with sizes `rdx` and `rcx` and returns the boolean in `rax`.
+// Strings of the same size are compared by `memcmp`
+void emit_string_equality(Assembler& a, const Runtime& runtime)
+{
+    int different = a.named_label("streq_different");
+
+    a.bind(runtime.MemoryRoutines[memory_routine(OpType::STREQ)]);
+    a.emit(Mnemonic::CMP, reg(Reg::RDX), reg(Reg::RCX));
+    a.emit(Mnemonic::JCC, Cond::NE, label(different));
+    a.emit(Mnemonic::CALL, label(runtime.MemoryRoutines[memory_routine(OpType::MEMCMP)]));
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), reg(Reg::RAX));
+    a.emit(Mnemonic::XOR, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::TEST, reg(Reg::RCX), reg(Reg::RCX));
+    a.emit(Mnemonic::SETCC, Cond::E, reg(Reg::RAX, 1));
+    a.emit(Mnemonic::RET);
+    a.bind(different);
+    a.emit(Mnemonic::XOR, reg(Reg::RAX), reg(Reg::RAX));
+    a.emit(Mnemonic::RET);
+}
+
+// Bytes read or written by a load or store operation
+uint8_t access_size(OpType type)
+{
+    switch (type)
+    {
+        case OpType::LOAD8:
+        case OpType::STORE8:
+        case OpType::LOAD8S:
+            return 1;
+        case OpType::LOAD16:
+        case OpType::STORE16:
+        case OpType::LOAD16S:
+            return 2;
+        case OpType::LOAD32:
+        case OpType::STORE32:
+        case OpType::LOAD32S:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+// Narrow values are zero- or sign-extended to the whole register by a single instruction
+void emit_load(Assembler& a, OpType type, Reg dst, Reg address)
+{
+    uint8_t size = access_size(type);
+    bool is_signed = type == OpType::LOAD8S || type == OpType::LOAD16S || type == OpType::LOAD32S;
+
+    if (is_signed) a.emit(Mnemonic::MOVSX, reg(dst), mem(address, 0, size));
+    else if (size >= 4) a.emit(Mnemonic::MOV, reg(dst, size), mem(address, 0, size));
+    else a.emit(Mnemonic::MOVZX, reg(dst, 4), mem(address, 0, size));
+}
+
+// Operations printing or formatting the number from `rdi`. Formatting ones write the digits to memory at
+// `rsi` and return their count in `rax`
+class NumberRoutine
+{
+public:
+    OpType Op;
+    const char* Name;
+    bool Signed;
+    bool Newline;
+    bool ToMemory;
+};
+
+const NumberRoutine NumberRoutines[NUMBER_ROUTINE_COUNT] = {
+    {OpType::PUT, "put", false, true, false},
+    {OpType::PUTD, "putd", true, true, false},
+    {OpType::PRINT, "print", false, false, false},
+    {OpType::PRINTD, "printd", true, false, false},
+    {OpType::FMT, "fmt", false, false, true},
+    {OpType::FMTD, "fmtd", true, false, true},
+};
+
+int number_routine(OpType type)
+{
+    for (int k = 0; k < NUMBER_ROUTINE_COUNT; ++k)
+    {
+        if (NumberRoutines[k].Op == type) return k;
+    }
+    return -1;
+}
+
+// Writes unsigned `rax` in decimal right before `rcx` and leaves `rcx` at the first digit. Two digits
+// are taken per step with a division by 100 done as a multiplication. Clobbers `rax`, `rdx`, `r8`, `r10` and `r11`
+void emit_format_digits(Assembler& a, const Runtime& runtime)
+{
+    int pair = a.named_label("format_digits_pair");
+    int last = a.named_label("format_digits_last");
+    int single = a.named_label("format_digits_single");
+
+    a.bind(runtime.FormatDigits);
+    a.emit(Mnemonic::MOV, reg(Reg::R11), label(runtime.DigitPairs));
+    a.bind(pair);
+    a.emit(Mnemonic::CMP, reg(Reg::RAX), imm(100));
+    a.emit(Mnemonic::JCC, Cond::B, label(last));
+    a.emit(Mnemonic::MOV, reg(Reg::R8), reg(Reg::RAX));
+    a.emit(Mnemonic::SHR, reg(Reg::RAX), imm(2));
+    a.emit(Mnemonic::MOV, reg(Reg::RDX), imm(0x28F5C28F5C28F5C3));
+    a.emit(Mnemonic::MUL, reg(Reg::RDX));
+    a.emit(Mnemonic::SHR, reg(Reg::RDX), imm(2));
+    a.emit(Mnemonic::LEA, reg(Reg::R10), mem(Reg::RDX, Reg::RDX, 4));
+    a.emit(Mnemonic::LEA, reg(Reg::R10), mem(Reg::R10, Reg::R10, 4));
+    a.emit(Mnemonic::SHL, reg(Reg::R10), imm(2));
+    a.emit(Mnemonic::SUB, reg(Reg::R8), reg(Reg::R10));
+    a.emit(Mnemonic::MOVZX, reg(Reg::R10, 4), mem(Reg::R11, Reg::R8, 2, 0, 2));
+    a.emit(Mnemonic::SUB, reg(Reg::RCX), imm(2));
+    a.emit(Mnemonic::MOV, mem(Reg::RCX, 0, 2), reg(Reg::R10, 2));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), reg(Reg::RDX));
+    a.emit(Mnemonic::JMP, label(pair));
+    a.bind(last);
+    a.emit(Mnemonic::CMP, reg(Reg::RAX), imm(10));
+    a.emit(Mnemonic::JCC, Cond::B, label(single));
+    a.emit(Mnemonic::MOVZX, reg(Reg::R10, 4), mem(Reg::R11, Reg::RAX, 2, 0, 2));
+    a.emit(Mnemonic::SUB, reg(Reg::RCX), imm(2));
+    a.emit(Mnemonic::MOV, mem(Reg::RCX, 0, 2), reg(Reg::R10, 2));
+    a.emit(Mnemonic::RET);
+    a.bind(single);
+    a.emit(Mnemonic::ADD, reg(Reg::RAX), imm('0'));
+    a.emit(Mnemonic::SUB, reg(Reg::RCX), imm(1));
+    a.emit(Mnemonic::MOV, mem(Reg::RCX, 0, 1), reg(Reg::RAX, 1));
+    a.emit(Mnemonic::RET);
+}
+
+// Digits are formatted into 40 bytes below the return address, ending at `rsp + 32`
+void emit_number_routine(Assembler& a, const Runtime& runtime, int k)
+{
+    const NumberRoutine& routine = NumberRoutines[k];
+
+    a.bind(runtime.Numbers[k]);
+    a.emit(Mnemonic::SUB, reg(Reg::RSP), imm(40));
+    a.emit(Mnemonic::MOV, reg(Reg::RAX), reg(Reg::RDI));
+    a.emit(Mnemonic::LEA, reg(Reg::RCX), mem(Reg::RSP, 32));
+    if (routine.Newline) a.emit(Mnemonic::MOV, mem(Reg::RSP, 32, 1), imm('\n'));
+
+    if (routine.Signed)
+    {
+        // `r9` is -1 for negative numbers and 0 otherwise, so the magnitude and the sign need no branches
+        a.emit(Mnemonic::MOV, reg(Reg::R9), reg(Reg::RAX));
+        a.emit(Mnemonic::SHR, reg(Reg::R9), imm(63));
+        a.emit(Mnemonic::XOR, reg(Reg::RDX), reg(Reg::RDX));
+        a.emit(Mnemonic::SUB, reg(Reg::RDX), reg(Reg::R9));
+        a.emit(Mnemonic::MOV, reg(Reg::R9), reg(Reg::RDX));
+        a.emit(Mnemonic::XOR, reg(Reg::RAX), reg(Reg::R9));
+        a.emit(Mnemonic::SUB, reg(Reg::RAX), reg(Reg::R9));
+        a.emit(Mnemonic::CALL, label(runtime.FormatDigits));
+        a.emit(Mnemonic::MOV, mem(Reg::RCX, -1, 1), imm('-'));
+        a.emit(Mnemonic::ADD, reg(Reg::RCX), reg(Reg::R9));
+    }
+    else a.emit(Mnemonic::CALL, label(runtime.FormatDigits));
+
+    if (routine.ToMemory)
+    {
+        a.emit(Mnemonic::JMP, label(runtime.FormatCopy));
+        return;
+    }
+
+    a.emit(Mnemonic::LEA, reg(Reg::RDX), mem(Reg::RSP, routine.Newline ? 33 : 32));
+    a.emit(Mnemonic::SUB, reg(Reg::RDX), reg(Reg::RCX));
+    a.emit(Mnemonic::MOV, reg(Reg::RSI), reg(Reg::RCX));
+    a.emit(Mnemonic::MOV, reg(Reg::RDI, 4), imm(1));
+    if (runtime.IsOutputBuffered) a.emit(Mnemonic::CALL, label(runtime.WriteOutput));
+    else
+    {
+        a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(1));
+        a.emit(Mnemonic::SYSCALL);
+    }
+    a.emit(Mnemonic::ADD, reg(Reg::RSP), imm(40));
+    a.emit(Mnemonic::RET);
+}
+
+// Common end of `fmt` and `fmtd`: copies the digits from `rcx` to `rsi` and returns their count
+void emit_format_copy(Assembler& a, const Runtime& runtime)
+{
+    int copy_byte = a.named_label("format_copy_byte");
+    int copied = a.named_label("format_copy_done");
+
+    a.bind(runtime.FormatCopy);
+    a.emit(Mnemonic::LEA, reg(Reg::RAX), mem(Reg::RSP, 32));
+    a.emit(Mnemonic::SUB, reg(Reg::RAX), reg(Reg::RCX));
+    a.emit(Mnemonic::XOR, reg(Reg::R8), reg(Reg::R8));
+    a.bind(copy_byte);
+    a.emit(Mnemonic::CMP, reg(Reg::R8), reg(Reg::RAX));
+    a.emit(Mnemonic::JCC, Cond::AE, label(copied));
+    a.emit(Mnemonic::MOV, reg(Reg::R10, 1), mem(Reg::RCX, Reg::R8, 1, 0, 1));
+    a.emit(Mnemonic::MOV, mem(Reg::RSI, Reg::R8, 1, 0, 1), reg(Reg::R10, 1));
+    a.emit(Mnemonic::ADD, reg(Reg::R8), imm(1));
+    a.emit(Mnemonic::JMP, label(copy_byte));
+    a.bind(copied);
+    a.emit(Mnemonic::ADD, reg(Reg::RSP), imm(40));
+    a.emit(Mnemonic::RET);
+}
+
+// Opposite conditions are encoded in pairs that differ in the lowest bit
+Cond inverse_condition(Cond condition)
+{
+    return static_cast<Cond>(static_cast<int>(condition) ^ 1);
+}
+
+// Comparison directly followed by `if` or `do` jumps on the flags instead of materializing the boolean
+bool is_fused_comparison(const Program& program, size_t i)
+{
+    if (i + 1 >= program.Ops.size()) return false;
+
+    switch (program.Ops[i].Type)
+    {
+        case OpType::EQ:
+        case OpType::NE:
+        case OpType::LT:
+        case OpType::GT:
+        case OpType::LE:
+        case OpType::GE:
+            return program.Ops[i + 1].Type == OpType::IF || program.Ops[i + 1].Type == OpType::DO;
+        default:
+            return false;
+    }
+}
+
+// Label `if` and `do` jump to when the condition is false
+int condition_target(const Operation& op)
+{
+    return op.Type == OpType::IF ? op.JumpTo : op.JumpTo - 1;
+}
+
+void emit_operation(Assembler& a, Runtime& runtime, const Program& program, size_t i)
+{
+    const Operation& op = program.Ops[i];
+
+    // Comparison result is materialized as 0 or 1 with conditional move
+    auto emit_comparison = [&a, &program, i](Cond condition, bool reversed) {
+        auto compare = [&a, reversed]() {
+            if (reversed) a.emit(Mnemonic::CMP, reg(Reg::RBX), reg(Reg::RAX));
+            else a.emit(Mnemonic::CMP, reg(Reg::RAX), reg(Reg::RBX));
+        };
+
+        a.emit(Mnemonic::POP, reg(Reg::RAX));
+        a.emit(Mnemonic::POP, reg(Reg::RBX));
+
+        if (is_fused_comparison(program, i))
+        {
+            compare();
+            a.emit(Mnemonic::JCC, inverse_condition(condition), label(condition_target(program.Ops[i + 1])));
+            return;
+        }
+
+        a.emit(Mnemonic::MOV, reg(Reg::RCX), imm(0));
+        a.emit(Mnemonic::MOV, reg(Reg::RDX), imm(1));
+        compare();
+        a.emit(Mnemonic::CMOVCC, condition, reg(Reg::RCX), reg(Reg::RDX));
+        a.emit(Mnemonic::PUSH, reg(Reg::RCX));
+    };
+
+    auto emit_binary = [&a](Mnemonic op) {
+        a.emit(Mnemonic::POP, reg(Reg::RAX));
+        a.emit(Mnemonic::POP, reg(Reg::RBX));
+        a.emit(op, reg(Reg::RAX), reg(Reg::RBX));
+        a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+    };
+
+    assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling");
+
+    switch (op.Type)
+    {
+        case OpType::PUSH_INT:
+        {
+            a.emit(Mnemonic::PUSH, imm(op.IntegerValue));
+            break;
+        }
+        case OpType::PUSH_STRING:
+        case OpType::HERE:
+        {
+            a.emit(Mnemonic::PUSH, imm(int64_t(program.Strings[op.StringId].size())));
+            runtime.UsedStrings[op.StringId] = true;
+            a.emit(Mnemonic::PUSH, label(a.string_label(op.StringId)));
+            break;
+        }
+        case OpType::PLUS:
+        {
+            emit_binary(Mnemonic::ADD);
+            break;
+        }
+        case OpType::MINUS:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::SUB, reg(Reg::RBX), reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::MUL:
+        {
+            emit_binary(Mnemonic::IMUL);
+            break;
+        }
+        case OpType::DIV:
+        case OpType::MOD:
+        case OpType::DIVMOD:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::XOR, reg(Reg::RDX), reg(Reg::RDX));
+            a.emit(Mnemonic::DIV, reg(Reg::RBX));
+            if (op.Type != OpType::MOD) a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            if (op.Type != OpType::DIV) a.emit(Mnemonic::PUSH, reg(Reg::RDX));
+            break;
+        }
+        case OpType::BOR:
+        {
+            emit_binary(Mnemonic::OR);
+            break;
+        }
+        case OpType::BAND:
+        {
+            emit_binary(Mnemonic::AND);
+            break;
+        }
+        case OpType::XOR:
+        {
+            emit_binary(Mnemonic::XOR);
+            break;
+        }
+        case OpType::SHL:
+        case OpType::SHR:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RCX));
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(op.Type == OpType::SHL ? Mnemonic::SHL : Mnemonic::SHR, reg(Reg::RAX), reg(Reg::RCX, 1));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::EQ: emit_comparison(Cond::E, false); break;
+        case OpType::NE: emit_comparison(Cond::NE, false); break;
+        case OpType::LT: emit_comparison(Cond::L, true); break;
+        case OpType::GT: emit_comparison(Cond::G, true); break;
+        case OpType::LE: emit_comparison(Cond::LE, true); break;
+        case OpType::GE: emit_comparison(Cond::GE, true); break;
+        case OpType::NOT:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::XOR, reg(Reg::RAX), imm(1));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::TRUE:
+        {
+            a.emit(Mnemonic::PUSH, imm(1));
+            break;
+        }
+        case OpType::FALSE:
+        {
+            a.emit(Mnemonic::PUSH, imm(0));
+            break;
+        }
+        case OpType::IF:
+        case OpType::DO:
+        {
+            // Already jumped on the flags of the comparison
+            if (i > 0 && is_fused_comparison(program, i - 1)) break;
+
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::MOV, reg(Reg::RBX), imm(0));
+            a.emit(Mnemonic::CMP, reg(Reg::RAX), reg(Reg::RBX));
+            a.emit(Mnemonic::JCC, Cond::E, label(condition_target(op)));
+            break;
+        }
+        case OpType::ELSE:
+        {
+            a.emit(Mnemonic::JMP, label(op.JumpTo));
+            a.bind(int(i) + 1);
+            break;
+        }
+        case OpType::END:
+        {
+            // Only the end of a `while` block jumps backwards
+            if (op.JumpTo < int(i)) a.emit(Mnemonic::JMP, label(op.JumpTo));
+            a.bind(int(i));
+            break;
+        }
+        case OpType::WHILE:
+        {
+            a.bind(int(i));
+            break;
+        }
+        case OpType::BIND:
+        {
+            assert(false, "Unreachable. All bindings should be expanded at the compilation step");
+        }
+        case OpType::MEM:
+        {
+            a.emit(Mnemonic::PUSH, label(runtime.Memory));
+            break;
+        }
+        case OpType::LOAD8:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::XOR, reg(Reg::RBX), reg(Reg::RBX));
+            a.emit(Mnemonic::MOV, reg(Reg::RBX, 1), mem(Reg::RAX, 0, 1));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::STORE8:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::MOV, mem(Reg::RAX, 0, 1), reg(Reg::RBX, 1));
+            break;
+        }
+        case OpType::LOAD64:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::XOR, reg(Reg::RBX), reg(Reg::RBX));
+            a.emit(Mnemonic::MOV, reg(Reg::RBX), mem(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::STORE64:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::MOV, mem(Reg::RAX), reg(Reg::RBX));
+            break;
+        }
+        case OpType::LOAD16:
+        case OpType::LOAD32:
+        case OpType::LOAD8S:
+        case OpType::LOAD16S:
+        case OpType::LOAD32S:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            emit_load(a, op.Type, Reg::RBX, Reg::RAX);
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::STORE16:
+        case OpType::STORE32:
+        {
+            uint8_t size = access_size(op.Type);
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::MOV, mem(Reg::RAX, 0, size), reg(Reg::RBX, size));
+            break;
+        }
+        case OpType::USE:
+        {
+            assert(false, "Unreachable. All `use` operations should be eliminated at the compilation step");
+        }
+        case OpType::PUT:
+        case OpType::PUTD:
+        case OpType::PRINT:
+        case OpType::PRINTD:
+        {
+            int k = number_routine(op.Type);
+            runtime.UsedNumbers[k] = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.Numbers[k]));
+            break;
+        }
+        case OpType::ALLOC:
+        {
+            runtime.IsHeapNeeded = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.Alloc));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::FREE:
+        {
+            runtime.IsHeapNeeded = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.Free));
+            break;
+        }
+        case OpType::ARENA_ALLOC:
+        {
+            runtime.IsHeapNeeded = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.ArenaAlloc));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::ARENA_RESET:
+        {
+            runtime.IsHeapNeeded = true;
+            a.emit(Mnemonic::CALL, label(runtime.ArenaReset));
+            break;
+        }
+        case OpType::MEMCPY:
+        case OpType::MEMSET:
+        case OpType::MEMCMP:
+        {
+            int k = memory_routine(op.Type);
+            runtime.UsedMemoryRoutines[k] = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDX));
+            a.emit(Mnemonic::POP, reg(Reg::RSI));
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.MemoryRoutines[k]));
+            if (op.Type == OpType::MEMCMP) a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::STRLEN:
+        {
+            runtime.UsedMemoryRoutines[memory_routine(op.Type)] = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.MemoryRoutines[memory_routine(op.Type)]));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::MEMCHR:
+        {
+            runtime.UsedMemoryRoutines[memory_routine(op.Type)] = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDX));
+            a.emit(Mnemonic::POP, reg(Reg::RSI));
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::CALL, label(runtime.MemoryRoutines[memory_routine(op.Type)]));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::STREQ:
+        {
+            runtime.UsedMemoryRoutines[memory_routine(OpType::MEMCMP)] = true;
+            runtime.UsedMemoryRoutines[memory_routine(op.Type)] = true;
+            a.emit(Mnemonic::POP, reg(Reg::RSI));
+            a.emit(Mnemonic::POP, reg(Reg::RCX));
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::POP, reg(Reg::RDX));
+            a.emit(Mnemonic::CALL, label(runtime.MemoryRoutines[memory_routine(op.Type)]));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::FMT:
+        case OpType::FMTD:
+        {
+            int k = number_routine(op.Type);
+            runtime.UsedNumbers[k] = true;
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::POP, reg(Reg::RSI));
+            a.emit(Mnemonic::CALL, label(runtime.Numbers[k]));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::FPUTS:
+        {
+            if (runtime.IsOutputBuffered)
+            {
+                a.emit(Mnemonic::POP, reg(Reg::RDI));
+                a.emit(Mnemonic::POP, reg(Reg::RSI));
+                a.emit(Mnemonic::POP, reg(Reg::RDX));
+                a.emit(Mnemonic::CALL, label(runtime.WriteOutput));
+                break;
+            }
+
+            a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(1));
+            a.emit(Mnemonic::POP, reg(Reg::RDI));
+            a.emit(Mnemonic::POP, reg(Reg::RSI));
+            a.emit(Mnemonic::POP, reg(Reg::RDX));
+            a.emit(Mnemonic::SYSCALL);
+            break;
+        }
+        case OpType::COPY:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::OVER:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::SWAP:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::SWAP2:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::POP, reg(Reg::RCX));
+            a.emit(Mnemonic::POP, reg(Reg::RDX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RDX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RCX));
+            break;
+        }
+        case OpType::DROP:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            break;
+        }
+        case OpType::ROT:
+        {
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            a.emit(Mnemonic::POP, reg(Reg::RBX));
+            a.emit(Mnemonic::POP, reg(Reg::RCX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RCX));
+            a.emit(Mnemonic::PUSH, reg(Reg::RBX));
+            break;
+        }
+        case OpType::SYSCALL0:
+        case OpType::SYSCALL1:
+        case OpType::SYSCALL2:
+        case OpType::SYSCALL3:
+        case OpType::SYSCALL4:
+        case OpType::SYSCALL5:
+        case OpType::SYSCALL6:
+        {
+            // Buffered output goes first, so it isn't reordered with what the syscall reads or writes
+            if (runtime.IsOutputBuffered) a.emit(Mnemonic::CALL, label(runtime.FlushOutput));
+            a.emit(Mnemonic::POP, reg(Reg::RAX));
+            int arguments = static_cast<int>(op.Type) - static_cast<int>(OpType::SYSCALL0);
+            for (int k = 0; k < arguments; ++k) a.emit(Mnemonic::POP, reg(SyscallRegisters[k]));
+            a.emit(Mnemonic::SYSCALL);
+            a.emit(Mnemonic::PUSH, reg(Reg::RAX));
+            break;
+        }
+        case OpType::CALL:
+        {
+            a.emit(Mnemonic::CALL, label(op.JumpTo));
+            break;
+        }
+        case OpType::PROC:
+        {
+            // Return address is moved to the return stack, so the procedure sees the data stack as is
+            a.bind(int(i));
+            a.emit(Mnemonic::SUB, reg(Reg::R15), imm(8));
+            a.emit(Mnemonic::POP, mem(Reg::R15));
+            break;
+        }
+        case OpType::RET:
+        {
+            a.emit(Mnemonic::PUSH, mem(Reg::R15));
+            a.emit(Mnemonic::ADD, reg(Reg::R15), imm(8));
+            a.emit(Mnemonic::RET);
+            break;
+        }
+        default:
+            assert(false, "Unreachable");
+    }
+}
+
+// Registers holding cached stack slots. `rax`, `rcx` and `rdx` stay free for division and shifts,
+// `r15` points to the return stack
+const Reg CacheRegisters[] = {Reg::RBX, Reg::RSI, Reg::RDI, Reg::R8, Reg::R9, Reg::R10, Reg::R11, Reg::R12, Reg::R13, Reg::R14};
+
+// Top of the data stack tracked at compile time: `Slots` are the topmost values, deepest first, kept
+// in registers or as known immediates instead of the hardware stack. Registers taken by the current
+// operation stay busy until `settle`
+class StackCache
+{
+public:
+    Assembler& Asm;
+    std::vector<Operand> Slots;
+    uint32_t Busy = 0;
+    // Register that keeps the top of the stack at the target of the jump being emitted, `COUNT` when
+    // the stack is fully spilled there
+    Reg Carried = Reg::COUNT;
+
+    StackCache(Assembler& a) : Asm(a) {}
+
+    Reg allocate()
+    {
+        while (true)
+        {
+            for (Reg r : CacheRegisters)
+            {
+                uint32_t bit = 1u << static_cast<int>(r);
+                if (Busy & bit) continue;
+                Busy |= bit;
+                return r;
+            }
+
+            assert(!Slots.empty(), "Stack cache ran out of registers");
+            spill_bottom();
+        }
+    }
+
+    void spill_bottom()
+    {
+        const Operand& bottom = Slots.front();
+        Asm.emit(Mnemonic::PUSH, bottom);
+        if (bottom.Kind == OperandKind::REG) Busy &= ~(1u << static_cast<int>(bottom.Base));
+        Slots.erase(Slots.begin());
+    }
+
+    void push(const Operand& value)
+    {
+        Slots.push_back(value);
+    }
+
+    Operand pop()
+    {
+        if (Slots.empty())
+        {
+            Reg r = allocate();
+            Asm.emit(Mnemonic::POP, reg(r));
+            return reg(r);
+        }
+
+        Operand top = Slots.back();
+        Slots.pop_back();
+        return top;
+    }
+
+    Reg materialize(const Operand& value)
+    {
+        if (value.Kind == OperandKind::REG) return value.Base;
+
+        Reg r = allocate();
+        Asm.emit(Mnemonic::MOV, reg(r), value);
+        return r;
+    }
+
+    Reg pop_register()
+    {
+        return materialize(pop());
+    }
+
+    // Loads values from the hardware stack until at least `count` slots are cached
+    void ensure(size_t count)
+    {
+        while (Slots.size() < count)
+        {
+            Reg r = allocate();
+            Asm.emit(Mnemonic::POP, reg(r));
+            Slots.insert(Slots.begin(), reg(r));
+        }
+    }
+
+    void flush()
+    {
+        for (const Operand& slot : Slots) Asm.emit(Mnemonic::PUSH, slot);
+        Slots.clear();
+        Busy = 0;
+    }
+
+    // Brings the cache to the state expected at a jump target. Emits only moves, pushes and pops, so
+    // flags of the preceding comparison survive
+    void settle_for_jump()
+    {
+        if (Carried == Reg::COUNT)
+        {
+            flush();
+            return;
+        }
+
+        if (Slots.empty()) Asm.emit(Mnemonic::POP, reg(Carried));
+        else
+        {
+            while (Slots.size() > 1) spill_bottom();
+            if (!is_register(Slots.back(), Carried)) Asm.emit(Mnemonic::MOV, reg(Carried), Slots.back());
+        }
+
+        Slots.assign(1, reg(Carried));
+        Busy = 1u << static_cast<int>(Carried);
+    }
+
+    void settle()
+    {
+        Busy = 0;
+        for (const Operand& slot : Slots)
+        {
+            if (slot.Kind == OperandKind::REG) Busy |= 1u << static_cast<int>(slot.Base);
+        }
+    }
+};
+
+// Unsigned division by a constant as multiplication by its reciprocal, from Granlund and Montgomery's
+// "Division by invariant integers using multiplication". Reciprocals that need 65 bits are applied
+// with an extra add step
+class DivisionMagic
+{
+public:
+    uint64_t Multiplier;
+    int Shift;
+    bool Add;
+};
+
+DivisionMagic division_magic(uint64_t divisor)
+{
+    using u128 = unsigned __int128;
+    int bits = 64 - std::countl_zero(divisor - 1);
+
+    for (int shift = 0; shift < bits; ++shift)
+    {
+        u128 power = u128(1) << (64 + shift);
+        u128 multiplier = (power + divisor - 1) / divisor;
+        if (multiplier >> 64) break;
+        if (multiplier * divisor - power <= u128(1) << shift) return {uint64_t(multiplier), shift, false};
+    }
+
+    u128 multiplier = (((u128(1) << bits) - divisor) << 64) / divisor + 1;
+    return {uint64_t(multiplier), bits - 1, true};
+}
+
+// Quotient ends up in `rdx` and the dividend stays in `rcx`, so the remainder is the dividend minus
+// the quotient times the divisor. Powers of two left by the folding pass take a shift and a mask
+void emit_constant_division(StackCache& cache, OpType type, const Operand& dividend, uint64_t divisor)
+{
+    Assembler& a = cache.Asm;
+    bool is_power = (divisor & (divisor - 1)) == 0;
+
+    a.emit(Mnemonic::MOV, reg(Reg::RCX), dividend);
+    if (is_power)
+    {
+        a.emit(Mnemonic::MOV, reg(Reg::RDX), reg(Reg::RCX));
+        if (divisor > 1) a.emit(Mnemonic::SHR, reg(Reg::RDX), imm(std::countr_zero(divisor)));
+    }
+    else
+    {
+        DivisionMagic magic = division_magic(divisor);
+        a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(int64_t(magic.Multiplier)));
+        a.emit(Mnemonic::MUL, reg(Reg::RCX));
+        if (magic.Add)
+        {
+            a.emit(Mnemonic::MOV, reg(Reg::RAX), reg(Reg::RCX));
+            a.emit(Mnemonic::SUB, reg(Reg::RAX), reg(Reg::RDX));
+            a.emit(Mnemonic::SHR, reg(Reg::RAX), imm(1));
+            a.emit(Mnemonic::ADD, reg(Reg::RDX), reg(Reg::RAX));
+        }
+        if (magic.Shift > 0) a.emit(Mnemonic::SHR, reg(Reg::RDX), imm(magic.Shift));
+    }
+
+    if (type != OpType::MOD)
+    {
+        Reg quotient = cache.allocate();
+        a.emit(Mnemonic::MOV, reg(quotient), reg(Reg::RDX));
+        cache.push(reg(quotient));
+    }
+    if (type != OpType::DIV)
+    {
+        Reg remainder = cache.allocate();
+        if (is_power)
+        {
+            a.emit(Mnemonic::MOV, reg(remainder), reg(Reg::RCX));
+            a.emit(Mnemonic::AND, reg(remainder), imm(int64_t(divisor - 1)));
+        }
+        else
+        {
+            a.emit(Mnemonic::MOV, reg(Reg::RAX), imm(int64_t(divisor)));
+            a.emit(Mnemonic::IMUL, reg(Reg::RDX), reg(Reg::RAX));
+            a.emit(Mnemonic::MOV, reg(remainder), reg(Reg::RCX));
+            a.emit(Mnemonic::SUB, reg(remainder), reg(Reg::RDX));
+        }
+        cache.push(reg(remainder));
+    }
+}
+
+// Same operations as `emit_operation`, but the stack is spilled to memory only at block boundaries,
+// calls, syscalls and `put`
+void emit_cached_operation(StackCache& cache, Runtime& runtime, const Program& program, size_t i)
+{
+    Assembler& a = cache.Asm;
+    const Operation& op = program.Ops[i];
+
+    auto emit_binary = [&cache, &a](Mnemonic instruction, bool commutative) {
+        Operand b = cache.pop();
+        Operand x = cache.pop();
+        if (commutative && x.Kind != OperandKind::REG && b.Kind == OperandKind::REG) std::swap(x, b);
+        Reg r = cache.materialize(x);
+        // Only the three operand form of `imul` takes an immediate
+        if (instruction == Mnemonic::IMUL && b.Kind != OperandKind::REG) b = reg(cache.materialize(b));
+        a.emit(instruction, reg(r), b);
+        cache.push(reg(r));
+    };
+
+    auto emit_comparison = [&cache, &a, &program, i](Cond condition) {
+        Operand b = cache.pop();
+        Reg r = cache.pop_register();
+        a.emit(Mnemonic::CMP, reg(r), b);
+        if (is_fused_comparison(program, i))
+        {
+            cache.settle_for_jump();
+            a.emit(Mnemonic::JCC, inverse_condition(condition), label(condition_target(program.Ops[i + 1])));
+            return;
+        }
+        a.emit(Mnemonic::SETCC, condition, reg(r, 1));
+        a.emit(Mnemonic::MOVZX, reg(r, 4), reg(r, 1));
+        cache.push(reg(r));
+    };
+
+    auto copy_slot = [&cache, &a](size_t depth) {
+        cache.ensure(depth + 1);
+        Operand value = cache.Slots[cache.Slots.size() - 1 - depth];
+        if (value.Kind == OperandKind::REG)
+        {
+            Reg r = cache.allocate();
+            a.emit(Mnemonic::MOV, reg(r), value);
+            value = reg(r);
+        }
+        cache.push(value);
+    };
+
+    assert(static_cast<int>(OpType::COUNT) == 75, "Exhaustive operations handling");
+
+    switch (op.Type)
+    {
+        case OpType::PUSH_INT:
+        {
+            cache.push(imm(op.IntegerValue));
+            break;
+        }
+        case OpType::PUSH_STRING:
+        case OpType::HERE:
+        {
+            runtime.UsedStrings[op.StringId] = true;
+            cache.push(imm(int64_t(program.Strings[op.StringId].size())));
+            cache.push(label(a.string_label(op.StringId)));
+            break;
+        }
+        case OpType::PLUS: emit_binary(Mnemonic::ADD, true); break;
+        case OpType::MINUS: emit_binary(Mnemonic::SUB, false); break;
+        case OpType::MUL: emit_binary(Mnemonic::IMUL, true); break;
+        case OpType::BOR: emit_binary(Mnemonic::OR, true); break;
+        case OpType::BAND: emit_binary(Mnemonic::AND, true); break;
+        case OpType::XOR: emit_binary(Mnemonic::XOR, true); break;
+        case OpType::DIV:
+        case OpType::MOD:
+        case OpType::DIVMOD:
+        {
+            Operand divisor = cache.pop();
+            if (divisor.Kind == OperandKind::IMM && divisor.Label < 0 && divisor.Value > 0)
+            {
+                emit_constant_division(cache, op.Type, cache.pop(), uint64_t(divisor.Value));
+                break;
+            }
+            a.emit(Mnemonic::MOV, reg(Reg::RAX), cache.pop());
+            if (divisor.Kind != OperandKind::REG)
+            {
+                a.emit(Mnemonic::MOV, reg(Reg::RCX), divisor);
+                divisor = reg(Reg::RCX);
+            }
+            a.emit(Mnemonic::XOR, reg(Reg::RDX), reg(Reg::RDX));
+            a.emit(Mnemonic::DIV, divisor);
+            if (op.Type != OpType::MOD)
+            {
+                Reg quotient = cache.allocate();
+                a.emit(Mnemonic::MOV, reg(quotient), reg(Reg::RAX));
+                cache.push(reg(quotient));
+            }
+            if (op.Type != OpType::DIV)
+            {
+                Reg remainder = cache.allocate();
+                a.emit(Mnemonic::MOV, reg(remainder), reg(Reg::RDX));
+                cache.push(reg(remainder));
+            }
+            break;
+        }
+        case OpType::SHL:
+        case OpType::SHR:
+        {
+            Mnemonic shift = op.Type == OpType::SHL ? Mnemonic::SHL : Mnemonic::SHR;
+            Operand count = cache.pop();
+            Reg r = cache.pop_register();
+            if (count.Kind == OperandKind::IMM && count.Label < 0)
+            {
+                // Shifts by zero are left by strength reduction of `1 *` and `1 /`
+                if (count.Value & 63) a.emit(shift, reg(r), imm(count.Value & 63));
+            }
+            else
+            {
+                a.emit(Mnemonic::MOV, reg(Reg::RCX), count);
+                a.emit(shift, reg(r), reg(Reg::RCX, 1));
+            }
+            cache.push(reg(r));
+            break;
+        }
+        case OpType::EQ: emit_comparison(Cond::E); break;
+        case OpType::NE: emit_comparison(Cond::NE); break;
+        case OpType::LT: emit_comparison(Cond::L); break;
+        case OpType::GT: emit_comparison(Cond::G); break;
+        case OpType::LE: emit_comparison(Cond::LE); break;
+        case OpType::GE: emit_comparison(Cond::GE); break;
+        case OpType::NOT:
+        {
+            Reg r = cache.pop_register();
+            a.emit(Mnemonic::XOR, reg(r), imm(1));
+            cache.push(reg(r));
+            break;
+        }
+        case OpType::TRUE:
+        {
+            cache.push(imm(1));
+            break;
+        }
+        case OpType::FALSE:
+        {
+            cache.push(imm(0));
+            break;
+        }
+        case OpType::IF:
+        case OpType::DO:
+        {
+            if (i > 0 && is_fused_comparison(program, i - 1)) break;
+
+            Reg r = cache.pop_register();
+            a.emit(Mnemonic::TEST, reg(r), reg(r));
+            cache.settle_for_jump();
+            a.emit(Mnemonic::JCC, Cond::E, label(condition_target(op)));
+            break;
+        }
+        case OpType::MEM:
+        {
+            cache.push(label(runtime.Memory));
+            break;
+        }
+        case OpType::LOAD8:
+        case OpType::LOAD16:
+        case OpType::LOAD32:
+        case OpType::LOAD64:
+        case OpType::LOAD8S:
+        case OpType::LOAD16S:
+        case OpType::LOAD32S:
+        {
+            Reg r = cache.pop_register();
+            emit_load(a, op.Type, r, r);
+            cache.push(reg(r));
+            break;
+        }
+        case OpType::STORE8:
+        case OpType::STORE16:
+        case OpType::STORE32:
+        {
+            uint8_t size = access_size(op.Type);
+            Operand value = cache.pop();
+            Reg address = cache.pop_register();
+            if (value.Kind == OperandKind::IMM && value.Label < 0)
+            {
+                // Only the stored bytes of the immediate matter
+                int64_t v = value.Value;
+                value = imm(size == 1 ? int64_t(int8_t(v)) : size == 2 ? int64_t(int16_t(v)) : int64_t(int32_t(v)));
+            }
+            else value = reg(cache.materialize(value), size);
+            a.emit(Mnemonic::MOV, mem(address, 0, size), value);
+            break;
+        }
+        case OpType::STORE64:
+        {
+            Operand value = cache.pop();
+            Reg address = cache.pop_register();
+            a.emit(Mnemonic::MOV, mem(address), value);
+            break;
+        }
+        case OpType::PUT:
+        case OpType::PUTD:
+        case OpType::PRINT:
+        case OpType::PRINTD:
+        {
+            int k = number_routine(op.Type);
+            runtime.UsedNumbers[k] = true;
+            Operand value = cache.pop();
+            cache.flush();
+            if (!is_register(value, Reg::RDI)) a.emit(Mnemonic::MOV, reg(Reg::RDI), value);
+            a.emit(Mnemonic::CALL, label(runtime.Numbers[k]));
+            break;
+        }
+        case OpType::COPY: copy_slot(0); break;
+        case OpType::OVER: copy_slot(1); break;
+        case OpType::SWAP:
+        {
+            cache.ensure(2);
+            size_t n = cache.Slots.size();
+            std::swap(cache.Slots[n - 1], cache.Slots[n - 2]);
+            break;
+        }
+        case OpType::SWAP2:
+        {
+            cache.ensure(4);
+            size_t n = cache.Slots.size();
+            std::swap(cache.Slots[n - 4], cache.Slots[n - 2]);
+            std::swap(cache.Slots[n - 3], cache.Slots[n - 1]);
+            break;
+        }
+        case OpType::ROT:
+        {
+            cache.ensure(3);
+            std::rotate(cache.Slots.end() - 3, cache.Slots.end() - 1, cache.Slots.end());
+            break;
+        }
+        case OpType::DROP:
+        {
+            if (!cache.Slots.empty()) cache.Slots.pop_back();
+            else a.emit(Mnemonic::ADD, reg(Reg::RSP), imm(8));
+            break;
+        }
+        case OpType::BIND:
+        case OpType::USE:
+        {
+            assert(false, "Unreachable. Bindings and `use` operations should be eliminated at the compilation step");
+        }
+        default:
+        {
+            // Labels, jumps, calls and syscalls work with the hardware stack only
+            cache.flush();
+            emit_operation(a, runtime, program, i);
+        }
+    }
+
+    cache.settle();
+}
+
+// Longest `while` condition that is compiled a second time at the bottom of its loop
+const int MAX_ROTATED_CONDITION = 16;
+
+// `do` of the `while` loop ending at `end` when the loop is rotated, otherwise -1. Short straight-line
+// conditions are compiled once more after the body and jump back while they hold, so an iteration
+// takes one branch instead of two
+int rotated_loop_condition(const Program& program, size_t end)
+{
+    const Operation& op = program.Ops[end];
+    if (op.Type != OpType::END || op.JumpTo >= int(end) || program.Ops[op.JumpTo].Type != OpType::WHILE) return -1;
+
+    for (int k = op.JumpTo + 1; k < int(end) && k - op.JumpTo <= MAX_ROTATED_CONDITION + 1; ++k)
+    {
+        switch (program.Ops[k].Type)
+        {
+            case OpType::DO:
+                return program.Ops[k].JumpTo == int(end) + 1 ? k : -1;
+            case OpType::IF:
+            case OpType::ELSE:
+            case OpType::END:
+            case OpType::WHILE:
+            case OpType::PROC:
+            case OpType::RET:
+                return -1;
+            default:
+                break;
+        }
+    }
+
+    return -1;
+}
+
+void remove_unused_labels(Assembler& a);
+void optimize_peephole(Assembler& a);
+
+void generate_linux_x86_64(Assembler& a, const Program& program, bool optimize, OutputBuffering buffering)
+{
+    Runtime runtime;
+    runtime.UsedStrings.assign(program.Strings.size(), false);
+    runtime.Buffering = buffering;
+    runtime.IsOutputBuffered = buffering != OutputBuffering::NONE && std::any_of(program.Ops.begin(), program.Ops.end(), [](const Operation& op) {
+        int k = number_routine(op.Type);
+        return (k >= 0 && !NumberRoutines[k].ToMemory) || op.Type == OpType::FPUTS;
+    });
+
+    int start = a.named_label("_start");
+    for (int k = 0; k < NUMBER_ROUTINE_COUNT; ++k) runtime.Numbers[k] = a.named_label(NumberRoutines[k].Name);
+    runtime.Alloc = a.named_label("alloc");
+    runtime.Free = a.named_label("free");
+    runtime.ArenaAlloc = a.named_label("arena_alloc");
+    runtime.ArenaReset = a.named_label("arena_reset");
+    runtime.HeapState = a.named_label("heap_state");
+    runtime.MemoryRoutines[memory_routine(OpType::MEMCPY)] = a.named_label("memcpy");
+    runtime.MemoryRoutines[memory_routine(OpType::MEMSET)] = a.named_label("memset");
+    runtime.MemoryRoutines[memory_routine(OpType::MEMCMP)] = a.named_label("memcmp");
+    runtime.MemoryRoutines[memory_routine(OpType::STRLEN)] = a.named_label("strlen");
+    runtime.MemoryRoutines[memory_routine(OpType::MEMCHR)] = a.named_label("memchr");
+    runtime.MemoryRoutines[memory_routine(OpType::STREQ)] = a.named_label("streq");
+    runtime.FormatDigits = a.named_label("format_digits");
+    runtime.FormatCopy = a.named_label("format_copy");
+    runtime.DigitPairs = a.named_label("digit_pairs");
+    runtime.Memory = a.named_label("mem");
+    runtime.ReturnStack = a.named_label("ret_stack");
+    runtime.WriteOutput = a.named_label("write_output");
+    runtime.FlushOutput = a.named_label("flush_output");
+    runtime.Output = a.named_label("output");
+    runtime.OutputState = a.named_label("output_state");
+
+    auto emit_program_exit = [&a, &runtime]() {
+        if (runtime.IsOutputBuffered) a.emit(Mnemonic::CALL, label(runtime.FlushOutput));
+        emit_exit(a);
+    };
+
+    a.bind(start);
+
+    if (program.CallDepth > 0) a.emit(Mnemonic::MOV, reg(Reg::R15), label(runtime.ReturnStack, program.CallDepth * 8));
+
+    StackCache cache(a);
+    bool entry_finished = false;
+
+    for (size_t i = 0; i < program.Ops.size(); ++i)
+    {
+        // Procedures follow the entry code, so the first one marks where the program exits
+        if (program.Ops[i].Type == OpType::PROC && !entry_finished)
+        {
+            emit_program_exit();
+            entry_finished = true;
+        }
+
+        a.emit(Mnemonic::COMMENT, imm(int64_t(i)));
+
+        if (!optimize)
+        {
+            emit_operation(a, runtime, program, i);
+            continue;
+        }
+
+        // The body of a rotated loop is entered with the top of the stack in a register that the bottom
+        // test keeps there, so a loop counter doesn't go through memory on every iteration
+        Reg carried = CacheRegisters[0];
+        const Operation& op = program.Ops[i];
+
+        int body = rotated_loop_condition(program, i);
+        if (body >= 0)
+        {
+            cache.Carried = carried;
+            for (int k = op.JumpTo + 1; k <= body; ++k)
+            {
+                a.emit(Mnemonic::COMMENT, imm(k));
+                emit_cached_operation(cache, runtime, program, size_t(k));
+            }
+            cache.Carried = Reg::COUNT;
+
+            // A fused comparison jumps before the comment of `do`
+            size_t last = a.Code.size() - 1;
+            while (a.Code[last].Op == Mnemonic::COMMENT) --last;
+            Instruction& exit_jump = a.Code[last];
+            assert(exit_jump.Op == Mnemonic::JCC, "Loop condition should end with a conditional jump");
+            exit_jump.Condition = inverse_condition(exit_jump.Condition);
+            exit_jump.Dst = label(body);
+
+            cache.flush();
+            a.bind(int(i));
+            continue;
+        }
+
+        emit_cached_operation(cache, runtime, program, i);
+
+        if (op.Type == OpType::DO && rotated_loop_condition(program, size_t(op.JumpTo - 1)) == int(i))
+        {
+            cache.Carried = carried;
+            cache.settle_for_jump();
+            cache.Carried = Reg::COUNT;
+            a.bind(int(i));
+            a.CarriedRegisters[int(i)] = carried;
+        }
+    }
+
+    if (!entry_finished) emit_program_exit();
+
+    // Runtime routines return their results in registers, while the peephole pass takes every register
+    // as dead at `ret`, so it only sees the program's own code
+    if (optimize)
+    {
+        remove_unused_labels(a);
+        optimize_peephole(a);
+    }
+
+    bool is_formatting = false;
+    bool is_copying = false;
+    for (int k = 0; k < NUMBER_ROUTINE_COUNT; ++k)
+    {
+        if (!runtime.UsedNumbers[k]) continue;
+        emit_number_routine(a, runtime, k);
+        is_formatting = true;
+        is_copying = is_copying || NumberRoutines[k].ToMemory;
+    }
+    if (is_copying) emit_format_copy(a, runtime);
+    if (is_formatting) emit_format_digits(a, runtime);
+    if (runtime.IsOutputBuffered) emit_output_buffer(a, runtime);
+    if (runtime.IsHeapNeeded) emit_heap(a, runtime);
+    if (runtime.UsedMemoryRoutines[memory_routine(OpType::MEMCPY)]) emit_memory_transfer(a, runtime, true);
+    if (runtime.UsedMemoryRoutines[memory_routine(OpType::MEMSET)]) emit_memory_transfer(a, runtime, false);
+    if (runtime.UsedMemoryRoutines[memory_routine(OpType::MEMCMP)]) emit_memory_compare(a, runtime);
+    if (runtime.UsedMemoryRoutines[memory_routine(OpType::STRLEN)]) emit_byte_search(a, runtime, false);
+    if (runtime.UsedMemoryRoutines[memory_routine(OpType::MEMCHR)]) emit_byte_search(a, runtime, true);
+    if (runtime.UsedMemoryRoutines[memory_routine(OpType::STREQ)]) emit_string_equality(a, runtime);
+
+    for (size_t id = 0; id < program.Strings.size(); ++id)
+    {
+        if (runtime.UsedStrings[id]) a.Data.push_back({a.string_label(int(id)), program.Strings[id]});
+    }
+
+    if (is_formatting) a.Data.push_back({runtime.DigitPairs, std::string_view(DIGIT_PAIRS.Bytes, sizeof(DIGIT_PAIRS.Bytes))});
+
+    a.Bss.push_back({runtime.Memory, 640000});
+    if (program.CallDepth > 0) a.Bss.push_back({runtime.ReturnStack, size_t(program.CallDepth) * 8});
+    if (runtime.IsHeapNeeded) a.Bss.push_back({runtime.HeapState, size_t(HEAP_STATE_SIZE)});
+    if (runtime.IsOutputBuffered)
+    {
+        a.Bss.push_back({runtime.Output, size_t(OUTPUT_BUFFER_SIZE)});
+        a.Bss.push_back({runtime.OutputState, 16});
+    }
+}
+// `xor r, r` doesn't depend on the previous value of `r`
+bool is_zeroing(const Instruction& ins)
+{
+    return ins.Op == Mnemonic::XOR && ins.Dst.Kind == OperandKind::REG && is_register(ins.Src, ins.Dst.Base);
+}
+
+bool reads_register(const Instruction& ins, Reg r)
+{
+    if (is_zeroing(ins)) return false;
+    if ((ins.Op == Mnemonic::MUL || ins.Op == Mnemonic::DIV) && (r == Reg::RAX || r == Reg::RDX)) return true;
+    if (uses_register(ins.Src, r)) return true;
+    if (ins.Dst.Kind == OperandKind::MEM) return uses_register(ins.Dst, r);
+    if (!is_register(ins.Dst, r)) return false;
+
+    switch (ins.Op)
+    {
+        case Mnemonic::MOV:
+        case Mnemonic::MOVZX:
+        case Mnemonic::MOVSX:
+        case Mnemonic::LEA:
+        case Mnemonic::POP:
+        case Mnemonic::SETCC:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Writes to 8 and 16 bit parts keep the rest of the register, so they don't end its lifetime
+bool overwrites_register(const Instruction& ins, Reg r)
+{
+    if ((ins.Op == Mnemonic::MUL || ins.Op == Mnemonic::DIV) && (r == Reg::RAX || r == Reg::RDX)) return true;
+    if (!is_register(ins.Dst, r) || ins.Dst.Size < 4) return false;
+
+    return is_zeroing(ins) || ins.Op == Mnemonic::MOV || ins.Op == Mnemonic::MOVZX || ins.Op == Mnemonic::MOVSX || ins.Op == Mnemonic::LEA || ins.Op == Mnemonic::POP;
+}
+
+// Values are kept in registers only within a straight line of operations, so no register is live at
+// an operation's label, except the top of the stack carried into a rotated loop body. Everything else
+// is treated conservatively: calls may read any register, runtime labels keep them live
+bool register_dead_after(const Assembler& a, size_t from, Reg r)
+{
+    for (size_t i = from; i < a.Code.size(); ++i)
+    {
+        const Instruction& ins = a.Code[i];
+
+        switch (ins.Op)
+        {
+            case Mnemonic::COMMENT:
+                break;
+            case Mnemonic::JCC:
+                if (!a.is_op_label(ins.Dst.Label) || a.is_carried(ins.Dst.Label, r)) return false;
+                break;
+            case Mnemonic::LABEL:
+            case Mnemonic::JMP:
+                return a.is_op_label(ins.Dst.Label) && !a.is_carried(ins.Dst.Label, r);
+            // Procedures of the program pass values on the data stack
+            case Mnemonic::RET:
+                return true;
+            case Mnemonic::CALL:
+                return false;
+            case Mnemonic::SYSCALL:
+                if (r == Reg::RAX || r == Reg::RDI || r == Reg::RSI || r == Reg::RDX || r == Reg::R10 || r == Reg::R8 || r == Reg::R9) return false;
+                if (r == Reg::RCX || r == Reg::R11) return true;
+                break;
+            case Mnemonic::REP_MOVSB:
+            case Mnemonic::REP_STOSB:
+                if (r == Reg::RDI || r == Reg::RCX || r == (ins.Op == Mnemonic::REP_MOVSB ? Reg::RSI : Reg::RAX)) return false;
+                break;
+            default:
+                if (reads_register(ins, r)) return false;
+                if (overwrites_register(ins, r)) return true;
+        }
+    }
+
+    return true;
+}
+
+// Adjacent instructions matched by a peephole rule. Comments in between are skipped
+class PeepholeWindow
+{
+public:
+    const Assembler& Asm;
+    size_t Indices[4];
+    size_t End;
+
+    const Instruction& operator[](int i) const { return Asm.Code[Indices[i]]; }
+    bool dead_after(Reg r) const { return register_dead_after(Asm, End, r); }
+};
+
+class PeepholeRule
+{
+public:
+    const char* Name;
+    int Size;
+    bool (*Rewrite)(const PeepholeWindow& w, std::vector<Instruction>& out);
+};
+
+const PeepholeRule PeepholeRules[] = {
+    {"push-pop-same", 2, [](const PeepholeWindow& w, std::vector<Instruction>&) {
+        return w[0].Op == Mnemonic::PUSH && w[1].Op == Mnemonic::POP &&
+            w[0].Dst.Kind == OperandKind::REG && is_register(w[1].Dst, w[0].Dst.Base);
+    }},
+    {"pop-push-same", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::POP || w[1].Op != Mnemonic::PUSH || w[0].Dst.Kind != OperandKind::REG) return false;
+        if (!is_register(w[1].Dst, w[0].Dst.Base)) return false;
+        out.push_back({Mnemonic::MOV, Cond::COUNT, w[0].Dst, mem(Reg::RSP)});
+        return true;
+    }},
+    {"push-pop-move", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::PUSH || w[1].Op != Mnemonic::POP) return false;
+        const Operand& from = w[0].Dst;
+        const Operand& to = w[1].Dst;
+        if (from.Kind == OperandKind::MEM && to.Kind == OperandKind::MEM) return false;
+        if (uses_register(from, Reg::RSP) || uses_register(to, Reg::RSP)) return false;
+        out.push_back({Mnemonic::MOV, Cond::COUNT, to, from});
+        return true;
+    }},
+    {"dead-zeroing", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (!is_zeroing(w[0])) return false;
+        Reg r = w[0].Dst.Base;
+        if (reads_register(w[1], r) || !overwrites_register(w[1], r)) return false;
+        out.push_back(w[1]);
+        return true;
+    }},
+    {"cmov-to-setcc", 4, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::MOV || w[1].Op != Mnemonic::MOV || w[2].Op != Mnemonic::CMP || w[3].Op != Mnemonic::CMOVCC) return false;
+        if (w[0].Dst.Kind != OperandKind::REG || !is_immediate(w[0].Src, 0)) return false;
+        if (w[1].Dst.Kind != OperandKind::REG || !is_immediate(w[1].Src, 1)) return false;
+        Reg result = w[0].Dst.Base;
+        Reg one = w[1].Dst.Base;
+        if (!is_register(w[3].Dst, result) || !is_register(w[3].Src, one)) return false;
+        for (Reg r : {result, one})
+        {
+            if (uses_register(w[2].Dst, r) || uses_register(w[2].Src, r)) return false;
+        }
+        if (!w.dead_after(one)) return false;
+        out.push_back(w[2]);
+        out.push_back({Mnemonic::SETCC, w[3].Condition, reg(result, 1), {}});
+        out.push_back({Mnemonic::MOVZX, Cond::COUNT, reg(result, 4), reg(result, 1)});
+        return true;
+    }},
+    {"zero-compare-to-test", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::MOV || w[1].Op != Mnemonic::CMP) return false;
+        if (w[0].Dst.Kind != OperandKind::REG || !is_immediate(w[0].Src, 0)) return false;
+        Reg zero = w[0].Dst.Base;
+        if (!is_register(w[1].Src, zero) || w[1].Dst.Kind != OperandKind::REG || w[1].Dst.Base == zero) return false;
+        if (!w.dead_after(zero)) return false;
+        out.push_back({Mnemonic::TEST, Cond::COUNT, w[1].Dst, w[1].Dst});
+        return true;
+    }},
+    {"forward-push", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::MOV || w[1].Op != Mnemonic::PUSH) return false;
+        if (w[0].Dst.Kind != OperandKind::REG || w[0].Dst.Size != 8 || !is_register(w[1].Dst, w[0].Dst.Base)) return false;
+        const Operand& value = w[0].Src;
+        if (value.Kind == OperandKind::IMM && !fits_imm32(value)) return false;
+        if (!w.dead_after(w[0].Dst.Base)) return false;
+        out.push_back({Mnemonic::PUSH, Cond::COUNT, value, {}});
+        return true;
+    }},
+    {"forward-move", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::MOV || w[0].Dst.Kind != OperandKind::REG || w[0].Dst.Size != 8) return false;
+        switch (w[1].Op)
+        {
+            case Mnemonic::MOV:
+            case Mnemonic::ADD:
+            case Mnemonic::SUB:
+            case Mnemonic::AND:
+            case Mnemonic::OR:
+            case Mnemonic::XOR:
+            case Mnemonic::CMP:
+                break;
+            default:
+                return false;
+        }
+        Reg temporary = w[0].Dst.Base;
+        const Operand& value = w[0].Src;
+        const Operand& target = w[1].Dst;
+        if (!is_register(w[1].Src, temporary) || w[1].Src.Size != 8 || uses_register(target, temporary)) return false;
+        if (value.Kind == OperandKind::IMM && !fits_imm32(value)) return false;
+        if (value.Kind == OperandKind::MEM && target.Kind == OperandKind::MEM) return false;
+        if (!w.dead_after(temporary)) return false;
+        out.push_back({w[1].Op, Cond::COUNT, target, value});
+        return true;
+    }},
+    {"forward-test", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::MOV || w[1].Op != Mnemonic::TEST || w[0].Dst.Kind != OperandKind::REG || w[0].Dst.Size != 8) return false;
+        Reg temporary = w[0].Dst.Base;
+        if (!is_register(w[1].Dst, temporary) || !is_register(w[1].Src, temporary) || w[0].Src.Kind != OperandKind::REG) return false;
+        if (!w.dead_after(temporary)) return false;
+        out.push_back({Mnemonic::TEST, Cond::COUNT, w[0].Src, w[0].Src});
+        return true;
+    }},
+    // `inc` keeps the carry flag, which is fine only when the next instruction sets all the flags anew
+    {"increment-before-compare", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::ADD || w[0].Dst.Kind != OperandKind::REG || !is_immediate(w[0].Src, 1)) return false;
+        if (w[1].Op != Mnemonic::CMP && w[1].Op != Mnemonic::TEST) return false;
+        out.push_back({Mnemonic::INC, Cond::COUNT, w[0].Dst, {}});
+        out.push_back(w[1]);
+        return true;
+    }},
+    {"forward-compare", 2, [](const PeepholeWindow& w, std::vector<Instruction>& out) {
+        if (w[0].Op != Mnemonic::MOV || w[1].Op != Mnemonic::CMP || w[0].Dst.Kind != OperandKind::REG || w[0].Dst.Size != 8) return false;
+        Reg temporary = w[0].Dst.Base;
+        if (!is_register(w[1].Dst, temporary) || w[1].Dst.Size != 8 || w[0].Src.Kind != OperandKind::REG) return false;
+        if (uses_register(w[1].Src, temporary) || !w.dead_after(temporary)) return false;
+        out.push_back({Mnemonic::CMP, Cond::COUNT, w[0].Src, w[1].Src});
+        return true;
+    }},
+};
+
+// Drops labels of operations that nothing jumps to, so they don't split straight-line code
+void remove_unused_labels(Assembler& a)
+{
+    std::vector<bool> used(a.OpLabels, false);
+    for (const Instruction& ins : a.Code)
+    {
+        if (ins.Op == Mnemonic::LABEL) continue;
+        for (const Operand* operand : {&ins.Dst, &ins.Src})
+        {
+            if (operand->Label >= 0 && a.is_op_label(operand->Label)) used[operand->Label] = true;
+        }
+    }
+
+    std::erase_if(a.Code, [&](const Instruction& ins) {
+        return ins.Op == Mnemonic::LABEL && a.is_op_label(ins.Dst.Label) && !used[ins.Dst.Label];
+    });
+}
+
+// Rewrites the instruction stream with `PeepholeRules` until none of them applies
+void optimize_peephole(Assembler& a)
+{
+    std::vector<Instruction> optimized;
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+        optimized.clear();
+        optimized.reserve(a.Code.size());
+
+        size_t i = 0;
+        while (i < a.Code.size())
+        {
+            bool rewritten = false;
+
+            for (const PeepholeRule& rule : PeepholeRules)
+            {
+                PeepholeWindow window{a, {i}, i + 1};
+                int matched = 1;
+                while (matched < rule.Size && window.End < a.Code.size())
+                {
+                    if (a.Code[window.End].Op != Mnemonic::COMMENT) window.Indices[matched++] = window.End;
+                    ++window.End;
+                }
+                if (matched < rule.Size) continue;
+
+                size_t mark = optimized.size();
+                for (size_t j = i + 1; j < window.End; ++j)
+                {
+                    if (a.Code[j].Op == Mnemonic::COMMENT) optimized.push_back(a.Code[j]);
+                }
+
+                if (rule.Rewrite(window, optimized))
+                {
+                    i = window.End;
+                    rewritten = changed = true;
+                    break;
+                }
+
+                optimized.resize(mark);
+            }
+
+            if (!rewritten) optimized.push_back(a.Code[i++]);
+        }
+
+        a.Code.swap(optimized);
+    }
+}
+
+// Text output collected in a large buffer and written to the file in big blocks. Integers and bytes
+// are formatted by hand, so writing a line costs no temporary strings or stream calls
+class AssemblyWriter
+{
+public:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    AssemblyWriter(const string& path) : Path(path), Buffer(new char[BUFFER_SIZE])
+    {
+        File = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (File < 0)
+        {
+            compilation_error("Can't open file: " + path);
+            exit(1);
+        }
+    }
+
+    ~AssemblyWriter()
+    {
+        flush();
+        close(File);
+    }
+
+    AssemblyWriter& operator<<(std::string_view text)
+    {
+        if (Size + text.size() > BUFFER_SIZE)
+        {
+            flush();
+            if (text.size() > BUFFER_SIZE) return write_through(text);
+        }
+        memcpy(Buffer.get() + Size, text.data(), text.size());
+        Size += text.size();
+        return *this;
+    }
+
+    AssemblyWriter& operator<<(char c)
+    {
+        if (Size == BUFFER_SIZE) flush();
+        Buffer[Size++] = c;
+        return *this;
+    }
+
+    AssemblyWriter& operator<<(int64_t value)
+    {
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        char* begin = end;
+        uint64_t magnitude = value < 0 ? 0 - uint64_t(value) : uint64_t(value);
+        do
+        {
+            *--begin = char('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (value < 0) *--begin = '-';
+        return *this << std::string_view(begin, size_t(end - begin));
+    }
+
+    // Writes `0x` followed by two lowercase hex digits
+    void put_hex_byte(uint8_t byte)
+    {
+        static const char digits[] = "0123456789abcdef";
+        if (Size + 4 > BUFFER_SIZE) flush();
+        char* out = Buffer.get() + Size;
+        out[0] = '0';
+        out[1] = 'x';
+        out[2] = digits[byte >> 4];
+        out[3] = digits[byte & 15];
+        Size += 4;
+    }
+
+    void flush()
+    {
+        write_through(std::string_view(Buffer.get(), Size));
+        Size = 0;
+    }
+
+private:
+    string Path;
+    std::unique_ptr<char[]> Buffer;
+    size_t Size = 0;
+    int File = -1;
+
+    AssemblyWriter& write_through(std::string_view text)
+    {
+        while (!text.empty())
+        {
+            ssize_t written = write(File, text.data(), text.size());
+            if (written < 0)
+            {
+                if (errno == EINTR) continue;
+                compilation_error("Can't write file: " + Path + ": " + strerror(errno));
+                exit(1);
+            }
+            text.remove_prefix(size_t(written));
+        }
+        return *this;
+    }
+};
+
+void print_label(AssemblyWriter& out, const Assembler& a, int id)
+{
+    if (a.is_op_label(id)) out << "addr_" << int64_t(id);
+    else if (id < a.OpLabels + a.StringLabels) out << "str_" << int64_t(id - a.OpLabels);
+    else out << a.Names[id - a.OpLabels - a.StringLabels];
+}
+
+void print_operand(AssemblyWriter& out, const Assembler& a, const Operand& operand, bool size_prefix)
+{
+    switch (operand.Kind)
+    {
+        case OperandKind::REG:
+        {
+            out << RegisterNames[size_index(operand.Size)][static_cast<int>(operand.Base)];
+            break;
+        }
+        case OperandKind::IMM:
+        {
+            if (operand.Label < 0)
+            {
+                out << operand.Value;
+                break;
+            }
+            print_label(out, a, operand.Label);
+            if (operand.Value > 0) out << " + " << operand.Value;
+            if (operand.Value < 0) out << " - " << -operand.Value;
+            break;
+        }
+        case OperandKind::MEM:
+        {
+            if (size_prefix) out << SizeNames[size_index(operand.Size)] << ' ';
+            out << '[';
+            out << RegisterNames[3][static_cast<int>(operand.Base)];
+            if (operand.Index != Reg::COUNT)
+            {
+                out << '+' << RegisterNames[3][static_cast<int>(operand.Index)];
+                if (operand.Scale > 1) out << '*' << int64_t(operand.Scale);
+            }
+            if (operand.Value > 0) out << '+' << operand.Value;
+            if (operand.Value < 0) out << operand.Value;
+            out << ']';
+            break;
+        }
+        default:
+            assert(false, "Unreachable");
+    }
+}
+
+Assembler assemble_linux_x86_64(const Program& program, bool optimize, OutputBuffering buffering)
+{
+    Assembler a(program.Ops.size(), program.Strings.size());
+    generate_linux_x86_64(a, program, optimize, buffering);
+    return a;
+}
+
+void generate_nasm_linux_x86_64(const string& output_file_path, const Assembler& a, const Program& program)
+{
+    AssemblyWriter out(output_file_path);
+
+    assert(static_cast<int>(Mnemonic::COUNT) == 31, "Exhaustive mnemonics handling");
+
+    out << "BITS 64\n";
+    out << "section .text\n";
+    out << "    global _start\n";
+
+    for (const Instruction& ins : a.Code)
+    {
+        if (ins.Op == Mnemonic::LABEL)
+        {
+            print_label(out, a, ins.Dst.Label);
+            out << ":\n";
+            continue;
+        }
+
+        if (ins.Op == Mnemonic::COMMENT)
+        {
+            const Operation& op = program.Ops[ins.Dst.Value];
+            out << "    ; -- " << HumanizedOpTypes.at(op.Type);
+            if (op.Type == OpType::CALL || op.Type == OpType::PROC) out << ' ' << program.Bindings[op.IntegerValue].Name;
+            out << " --\n";
+            continue;
+        }
+
+        std::string_view name = MnemonicNames[static_cast<int>(ins.Op)];
+        if (ins.Op == Mnemonic::MOVSX && ins.Src.Size == 4) name = "movsxd";
+        std::string_view condition = ins.Condition == Cond::COUNT ? "" : ConditionNames[static_cast<int>(ins.Condition)];
+        size_t width = name.size() + condition.size();
+
+        out << "    " << name << condition;
+        if (ins.Dst.Kind != OperandKind::NONE)
+        {
+            out << std::string_view("        ", width < 8 ? 8 - width : 1);
+            print_operand(out, a, ins.Dst, ins.Op != Mnemonic::LEA);
+        }
+        if (ins.Src.Kind != OperandKind::NONE)
+        {
+            out << ", ";
+            print_operand(out, a, ins.Src, ins.Op != Mnemonic::LEA);
+        }
+        out << '\n';
+    }
+
+    if (!a.Data.empty()) out << "\nsection .data\n";
+
+    for (const DataBlock& block : a.Data)
+    {
+        out << "    ";
+        print_label(out, a, block.Label);
+        out << ": db ";
+
+        for (size_t i = 0; i < block.Bytes.size(); ++i)
+        {
+            if (i > 0) out << ',';
+            out.put_hex_byte(uint8_t(block.Bytes[i]));
+        }
+
+        out << '\n';
+    }
+
+    out << "\nsegment .bss\n";
+
+    for (const BssBlock& block : a.Bss)
+    {
+        out << "    ";
+        print_label(out, a, block.Label);
+        out << ": resb " << int64_t(block.Size) << '\n';
+    }
+}
+
+// How the program runs: a static executable, NASM assembly built with `nasm` and `ld`, machine code
+// in memory, or the threaded code interpreter that needs no x86-64 code at all
+enum class Backend : uint8_t
+{
+    ELF,
+    NASM,
+    JIT,
+    INTERPRETER,
+    COUNT
+};
+
+enum class Section : uint8_t
+{
+    TEXT,
+    DATA,
+    BSS,
+    COUNT
+};
+
+// Reference to a label from `.text`: either a 32-bit displacement from the end of the field,
+// or a 32-bit absolute address, which is enough since everything is placed below 2GiB
+class Fixup
+{
+public:
+    size_t Offset;
+    int Label;
+    int64_t Addend;
+    bool Relative;
+};
+
+// Machine code and data of a program before the sections get their addresses
+class MachineCode
+{
+public:
+    std::vector<uint8_t> Text;
+    std::vector<uint8_t> Data;
+    size_t BssSize = 0;
+    std::vector<Section> LabelSections;
+    std::vector<size_t> LabelOffsets;
+    std::vector<Fixup> Fixups;
+};
+
+void put_bytes(std::vector<uint8_t>& out, uint64_t value, int count)
+{
+    for (int i = 0; i < count; ++i) out.push_back(uint8_t(value >> (8 * i)));
+}
+
+bool fits_int8(int64_t value)
+{
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+// `spl`, `bpl`, `sil` and `dil` need a REX prefix, otherwise the same encoding means `ah`..`bh`
+bool needs_byte_rex(const Operand& operand)
+{
+    return operand.Kind == OperandKind::REG && operand.Size == 1 && operand.Base >= Reg::RSP && operand.Base <= Reg::RDI;
+}
+
+// Emits prefixes, `opcode` and the ModRM, SIB and displacement bytes addressing `rm`, with `reg` in the reg field
+void encode_modrm(std::vector<uint8_t>& out, std::initializer_list<uint8_t> opcode, int reg, const Operand& rm, uint8_t size, bool force_rex = false)
+{
+    assert(rm.Kind == OperandKind::REG || (rm.Kind == OperandKind::MEM && rm.Label < 0 && rm.Base != Reg::COUNT), "Unsupported operand");
+
+    int base = static_cast<int>(rm.Base);
+    int index = rm.Kind == OperandKind::MEM && rm.Index != Reg::COUNT ? static_cast<int>(rm.Index) : 0;
+
+    if (size == 2) out.push_back(0x66);
+
+    uint8_t rex = 0x40 | (size == 8 ? 8 : 0) | (reg & 8 ? 4 : 0) | (index & 8 ? 2 : 0) | (base & 8 ? 1 : 0);
+    if (rex != 0x40 || force_rex) out.push_back(rex);
+
+    out.insert(out.end(), opcode);
+
+    if (rm.Kind == OperandKind::REG)
+    {
+        out.push_back(uint8_t(0xC0 | (reg & 7) << 3 | (base & 7)));
+        return;
+    }
+
+    assert(rm.Index != Reg::RSP, "`rsp` can't be used as an index");
+
+    int64_t displacement = rm.Value;
+    int mod = displacement == 0 && (base & 7) != 5 ? 0 : fits_int8(displacement) ? 1 : 2;
+    bool sib = rm.Index != Reg::COUNT || (base & 7) == 4;
+
+    out.push_back(uint8_t(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base & 7)));
+    if (sib)
+    {
+        int scale = rm.Scale == 8 ? 3 : rm.Scale == 4 ? 2 : rm.Scale == 2 ? 1 : 0;
+        int index_field = rm.Index != Reg::COUNT ? index & 7 : 4;
+        out.push_back(uint8_t(scale << 6 | index_field << 3 | (base & 7)));
+    }
+
+    if (mod == 1) put_bytes(out, uint64_t(displacement), 1);
+    if (mod == 2) put_bytes(out, uint64_t(displacement), 4);
+}
+
+// Emits an immediate of `count` bytes, or a fixup when it's the address of a label
+void encode_immediate(MachineCode& code, const Operand& operand, int count)
+{
+    if (operand.Label >= 0)
+    {
+        assert(count == 4, "Label addresses are encoded as 32-bit immediates");
+        code.Fixups.push_back({code.Text.size(), operand.Label, operand.Value, false});
+    }
+    put_bytes(code.Text, uint64_t(operand.Value), count);
+}
+
+void encode_branch(MachineCode& code, std::initializer_list<uint8_t> opcode, const Operand& target)
+{
+    code.Text.insert(code.Text.end(), opcode);
+    code.Fixups.push_back({code.Text.size(), target.Label, 0, true});
+    put_bytes(code.Text, 0, 4);
+}
+
+// Opcode extensions of the classic arithmetic group, also giving their `r/m, reg` opcodes as `extension * 8 + 1`
+int arithmetic_extension(Mnemonic op)
+{
+    switch (op)
+    {
+        case Mnemonic::ADD: return 0;
+        case Mnemonic::OR: return 1;
+        case Mnemonic::AND: return 4;
+        case Mnemonic::SUB: return 5;
+        case Mnemonic::XOR: return 6;
+        case Mnemonic::CMP: return 7;
+        default: assert(false, "Not an arithmetic instruction");
+    }
+    return 0;
+}
+
+void encode_instruction(MachineCode& code, const Instruction& ins)
+{
+    std::vector<uint8_t>& out = code.Text;
+    const Operand& dst = ins.Dst;
+    const Operand& src = ins.Src;
+    int condition = static_cast<int>(ins.Condition);
+
+    assert(static_cast<int>(Mnemonic::COUNT) == 31, "Exhaustive mnemonics handling");
+
+    switch (ins.Op)
+    {
+        case Mnemonic::MOV:
+        {
+            bool byte_rex = needs_byte_rex(dst) || needs_byte_rex(src);
+            if (src.Kind == OperandKind::REG)
             {
-                complete_string(output_content, "    ; -- store64 --");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    mov     [rax], rbx");
-                break;
+                encode_modrm(out, {uint8_t(dst.Size == 1 ? 0x88 : 0x89)}, static_cast<int>(src.Base), dst, dst.Size, byte_rex);
             }
-            case OpType::USE:
+            else if (src.Kind == OperandKind::MEM)
             {
-                assert(false, "Unreachable. All `use` operations should be eliminated at the compilation step");
+                encode_modrm(out, {uint8_t(dst.Size == 1 ? 0x8A : 0x8B)}, static_cast<int>(dst.Base), src, dst.Size, byte_rex);
             }
-            case OpType::PUT:
+            else if (dst.Kind == OperandKind::MEM || (dst.Size == 8 && fits_imm32(src) && (src.Label >= 0 || src.Value < 0)))
             {
-                complete_string(output_content, "    ; -- put --");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    call    put");
-                break;
+                // Sign-extended 32-bit immediate
+                encode_modrm(out, {uint8_t(dst.Size == 1 ? 0xC6 : 0xC7)}, 0, dst, dst.Size, byte_rex);
+                encode_immediate(code, src, dst.Size == 1 ? 1 : dst.Size == 2 ? 2 : 4);
             }
-            case OpType::FPUTS:
+            else
             {
-                complete_string(output_content, "    ; -- fputs --");
-                complete_string(output_content, "    mov     rax, 1");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    pop     rsi");
-                complete_string(output_content, "    pop     rdx");
-                complete_string(output_content, "    syscall");
-                break;
+                // Writing a 32-bit register clears the upper half, so 64-bit immediates are needed only for big values
+                int r = static_cast<int>(dst.Base);
+                uint8_t size = dst.Size == 8 && src.Value >= 0 && src.Value <= UINT32_MAX ? 4 : dst.Size;
+                if (size == 2) out.push_back(0x66);
+                uint8_t rex = 0x40 | (size == 8 ? 8 : 0) | (r & 8 ? 1 : 0);
+                if (rex != 0x40 || byte_rex) out.push_back(rex);
+                out.push_back(uint8_t((size == 1 ? 0xB0 : 0xB8) + (r & 7)));
+                put_bytes(out, uint64_t(src.Value), size);
             }
-            case OpType::HERE:
+            break;
+        }
+        case Mnemonic::MOVZX:
+        {
+            encode_modrm(out, {0x0F, uint8_t(src.Size == 1 ? 0xB6 : 0xB7)}, static_cast<int>(dst.Base), src, dst.Size, needs_byte_rex(src));
+            break;
+        }
+        case Mnemonic::MOVSX:
+        {
+            if (src.Size == 4) encode_modrm(out, {0x63}, static_cast<int>(dst.Base), src, dst.Size);
+            else encode_modrm(out, {0x0F, uint8_t(src.Size == 1 ? 0xBE : 0xBF)}, static_cast<int>(dst.Base), src, dst.Size, needs_byte_rex(src));
+            break;
+        }
+        case Mnemonic::LEA:
+        {
+            encode_modrm(out, {0x8D}, static_cast<int>(dst.Base), src, 8);
+            break;
+        }
+        case Mnemonic::PUSH:
+        {
+            if (dst.Kind == OperandKind::REG)
             {
-                string value = op.Loc;
-                complete_string(output_content, "    ; -- here --");
-                complete_string(output_content, "    push    " + std::to_string(value.size()));
-
-                auto it = strings.find(value);
-                if (it == strings.end()) strings[value] = int(strings.size());
-
-                complete_string(output_content, "    push    str_" + std::to_string(strings.at(value)));
-                break;
+                int r = static_cast<int>(dst.Base);
+                if (r & 8) out.push_back(0x41);
+                out.push_back(uint8_t(0x50 + (r & 7)));
             }
-            case OpType::COPY:
+            else if (dst.Kind == OperandKind::MEM)
             {
-                complete_string(output_content, "    ; -- copy --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    push    rax");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {0xFF}, 6, dst, 4);
             }
-            case OpType::OVER:
+            else if (dst.Label < 0 && fits_int8(dst.Value))
             {
-                complete_string(output_content, "    ; -- over --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    push    rbx");
-                complete_string(output_content, "    push    rax");
-                complete_string(output_content, "    push    rbx");
-                break;
+                out.push_back(0x6A);
+                put_bytes(out, uint64_t(dst.Value), 1);
             }
-            case OpType::SWAP:
+            else
             {
-                complete_string(output_content, "    ; -- swap --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    push    rax");
-                complete_string(output_content, "    push    rbx");
-                break;
+                out.push_back(0x68);
+                encode_immediate(code, dst, 4);
             }
-            case OpType::SWAP2:
+            break;
+        }
+        case Mnemonic::POP:
+        {
+            if (dst.Kind == OperandKind::MEM)
             {
-                complete_string(output_content, "    ; -- 2swap --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    pop     rcx");
-                complete_string(output_content, "    pop     rdx");
-                complete_string(output_content, "    push    rbx");
-                complete_string(output_content, "    push    rax");
-                complete_string(output_content, "    push    rdx");
-                complete_string(output_content, "    push    rcx");
+                encode_modrm(out, {0x8F}, 0, dst, 4);
                 break;
             }
-            case OpType::DROP:
+            int r = static_cast<int>(dst.Base);
+            if (r & 8) out.push_back(0x41);
+            out.push_back(uint8_t(0x58 + (r & 7)));
+            break;
+        }
+        case Mnemonic::ADD:
+        case Mnemonic::OR:
+        case Mnemonic::AND:
+        case Mnemonic::SUB:
+        case Mnemonic::XOR:
+        case Mnemonic::CMP:
+        {
+            int extension = arithmetic_extension(ins.Op);
+            bool byte_rex = needs_byte_rex(dst) || needs_byte_rex(src);
+            if (src.Kind == OperandKind::REG)
             {
-                complete_string(output_content, "    ; -- drop --");
-                complete_string(output_content, "    pop     rax");
-                break;
+                encode_modrm(out, {uint8_t(extension * 8 + (dst.Size == 1 ? 0 : 1))}, static_cast<int>(src.Base), dst, dst.Size, byte_rex);
             }
-            case OpType::ROT:
+            else if (src.Kind == OperandKind::MEM)
             {
-                complete_string(output_content, "    ; -- rot --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rbx");
-                complete_string(output_content, "    pop     rcx");
-                complete_string(output_content, "    push    rax");
-                complete_string(output_content, "    push    rcx");
-                complete_string(output_content, "    push    rbx");
-                break;
+                encode_modrm(out, {uint8_t(extension * 8 + (dst.Size == 1 ? 2 : 3))}, static_cast<int>(dst.Base), src, dst.Size, byte_rex);
             }
-            case OpType::SYSCALL0:
+            else if (dst.Size == 1 || (src.Label < 0 && fits_int8(src.Value)))
             {
-                complete_string(output_content, "    ; -- syscall0 --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {uint8_t(dst.Size == 1 ? 0x80 : 0x83)}, extension, dst, dst.Size, byte_rex);
+                put_bytes(out, uint64_t(src.Value), 1);
             }
-            case OpType::SYSCALL1:
+            else
             {
-                complete_string(output_content, "    ; -- syscall --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {0x81}, extension, dst, dst.Size);
+                encode_immediate(code, src, dst.Size == 2 ? 2 : 4);
             }
-            case OpType::SYSCALL2:
+            break;
+        }
+        case Mnemonic::TEST:
+        {
+            bool byte_rex = needs_byte_rex(dst) || needs_byte_rex(src);
+            if (src.Kind == OperandKind::REG)
             {
-                complete_string(output_content, "    ; -- syscall --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    pop     rsi");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {uint8_t(dst.Size == 1 ? 0x84 : 0x85)}, static_cast<int>(src.Base), dst, dst.Size, byte_rex);
             }
-            case OpType::SYSCALL3:
+            else
             {
-                complete_string(output_content, "    ; -- syscall --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    pop     rsi");
-                complete_string(output_content, "    pop     rdx");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {uint8_t(dst.Size == 1 ? 0xF6 : 0xF7)}, 0, dst, dst.Size, byte_rex);
+                encode_immediate(code, src, dst.Size == 1 ? 1 : dst.Size == 2 ? 2 : 4);
             }
-            case OpType::SYSCALL4:
+            break;
+        }
+        case Mnemonic::IMUL:
+        {
+            assert(src.Kind != OperandKind::IMM, "Only register and memory operands are supported by `imul`");
+            encode_modrm(out, {0x0F, 0xAF}, static_cast<int>(dst.Base), src, dst.Size);
+            break;
+        }
+        case Mnemonic::BSF:
+        {
+            encode_modrm(out, {0x0F, 0xBC}, static_cast<int>(dst.Base), src, 8);
+            break;
+        }
+        case Mnemonic::INC:
+        {
+            encode_modrm(out, {uint8_t(dst.Size == 1 ? 0xFE : 0xFF)}, 0, dst, dst.Size, needs_byte_rex(dst));
+            break;
+        }
+        case Mnemonic::MUL:
+        case Mnemonic::DIV:
+        {
+            encode_modrm(out, {0xF7}, ins.Op == Mnemonic::MUL ? 4 : 6, dst, dst.Size);
+            break;
+        }
+        case Mnemonic::SHL:
+        case Mnemonic::SHR:
+        {
+            int extension = ins.Op == Mnemonic::SHL ? 4 : 5;
+            if (src.Kind == OperandKind::REG)
             {
-                complete_string(output_content, "    ; -- syscall --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    pop     rsi");
-                complete_string(output_content, "    pop     rdx");
-                complete_string(output_content, "    pop     r10");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {0xD3}, extension, dst, dst.Size);
             }
-            case OpType::SYSCALL5:
+            else if (src.Value == 1)
             {
-                complete_string(output_content, "    ; -- syscall --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    pop     rsi");
-                complete_string(output_content, "    pop     rdx");
-                complete_string(output_content, "    pop     r10");
-                complete_string(output_content, "    pop     r8");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {0xD1}, extension, dst, dst.Size);
             }
-            case OpType::SYSCALL6:
+            else
             {
-                complete_string(output_content, "    ; -- syscall --");
-                complete_string(output_content, "    pop     rax");
-                complete_string(output_content, "    pop     rdi");
-                complete_string(output_content, "    pop     rsi");
-                complete_string(output_content, "    pop     rdx");
-                complete_string(output_content, "    pop     r10");
-                complete_string(output_content, "    pop     r8");
-                complete_string(output_content, "    pop     r9");
-                complete_string(output_content, "    syscall");
-                complete_string(output_content, "    push    rax");
-                break;
+                encode_modrm(out, {0xC1}, extension, dst, dst.Size);
+                put_bytes(out, uint64_t(src.Value), 1);
             }
-            default:
-                assert(false, "Unreachable");
+            break;
+        }
+        case Mnemonic::JMP: encode_branch(code, {0xE9}, dst); break;
+        case Mnemonic::JCC: encode_branch(code, {0x0F, uint8_t(0x80 + condition)}, dst); break;
+        case Mnemonic::CALL: encode_branch(code, {0xE8}, dst); break;
+        case Mnemonic::RET: out.push_back(0xC3); break;
+        case Mnemonic::SYSCALL: out.insert(out.end(), {0x0F, 0x05}); break;
+        case Mnemonic::REP_MOVSB: out.insert(out.end(), {0xF3, 0xA4}); break;
+        case Mnemonic::REP_STOSB: out.insert(out.end(), {0xF3, 0xAA}); break;
+        case Mnemonic::SETCC:
+        {
+            encode_modrm(out, {0x0F, uint8_t(0x90 + condition)}, 0, dst, 1, needs_byte_rex(dst));
+            break;
+        }
+        case Mnemonic::CMOVCC:
+        {
+            encode_modrm(out, {0x0F, uint8_t(0x40 + condition)}, static_cast<int>(dst.Base), src, dst.Size);
+            break;
+        }
+        case Mnemonic::LABEL:
+        {
+            code.LabelSections[dst.Label] = Section::TEXT;
+            code.LabelOffsets[dst.Label] = out.size();
+            break;
         }
+        case Mnemonic::COMMENT:
+            break;
+        default:
+            assert(false, "Unreachable");
+    }
+}
+
+MachineCode encode_linux_x86_64(const Assembler& a)
+{
+    MachineCode code;
+    size_t label_count = a.OpLabels + a.StringLabels + a.Names.size();
+    code.LabelSections.assign(label_count, Section::COUNT);
+    code.LabelOffsets.assign(label_count, 0);
+    code.Text.reserve(a.Code.size() * 4);
+
+    for (const Instruction& ins : a.Code) encode_instruction(code, ins);
+
+    for (const DataBlock& block : a.Data)
+    {
+        code.LabelSections[block.Label] = Section::DATA;
+        code.LabelOffsets[block.Label] = code.Data.size();
+        code.Data.insert(code.Data.end(), block.Bytes.begin(), block.Bytes.end());
     }
 
-    complete_string(output_content, "    ; -- exit --");
-    complete_string(output_content, "    mov     rax, 60");
-    complete_string(output_content, "    mov     rdi, 0");
-    complete_string(output_content, "    syscall");
+    for (const BssBlock& block : a.Bss)
+    {
+        code.BssSize = (code.BssSize + 15) & ~size_t(15);
+        code.LabelSections[block.Label] = Section::BSS;
+        code.LabelOffsets[block.Label] = code.BssSize;
+        code.BssSize += block.Size;
+    }
+
+    return code;
+}
+
+// Patches label references once the sections got their addresses
+void link_machine_code(MachineCode& code, uint64_t text_address, uint64_t data_address, uint64_t bss_address)
+{
+    const uint64_t addresses[] = {text_address, data_address, bss_address};
 
-    if (!strings.empty()) complete_string(output_content, "\nsection .data");
+    for (const Fixup& fixup : code.Fixups)
+    {
+        Section section = code.LabelSections[fixup.Label];
+        assert(section != Section::COUNT, "Reference to a label that is never bound");
 
-    out << output_content;
+        int64_t target = int64_t(addresses[static_cast<int>(section)] + code.LabelOffsets[fixup.Label]) + fixup.Addend;
+        int64_t value = fixup.Relative ? target - int64_t(text_address + fixup.Offset + 4) : target;
+        assert(value >= INT32_MIN && value <= INT32_MAX, "Label is out of reach of a 32-bit field");
 
-    for (const auto& pair : strings) {
-        out << "    str_" << pair.second << ": db ";
+        for (int i = 0; i < 4; ++i) code.Text[fixup.Offset + i] = uint8_t(uint64_t(value) >> (8 * i));
+    }
+}
 
-        const string& s = pair.first;
-        for (size_t i = 0; i < s.size(); ++i) {
-            out << "0x" << std::setw(2) << std::setfill('0') << std::hex << static_cast<int>(s[i]);
+const uint64_t ELF_BASE_ADDRESS = 0x400000;
+const uint64_t ELF_PAGE_SIZE = 0x1000;
 
-            if (i < s.size() - 1) {
-                out << ",";
-            }
-        }
+// Writes a static executable: the headers and `.text` are mapped as one read-execute segment,
+// `.data` and `.bss` follow on their own pages as one read-write segment
+void generate_elf_linux_x86_64(const string& output_file_path, const Assembler& a)
+{
+    MachineCode code = encode_linux_x86_64(a);
+
+    const char section_names[] = "\0.text\0.data\0.bss\0.shstrtab";
+    const size_t headers_size = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+
+    size_t text_offset = headers_size;
+    size_t data_offset = (text_offset + code.Text.size() + ELF_PAGE_SIZE - 1) & ~(ELF_PAGE_SIZE - 1);
+    size_t names_offset = data_offset + code.Data.size();
+    size_t section_headers_offset = (names_offset + sizeof(section_names) + 7) & ~size_t(7);
+
+    uint64_t text_address = ELF_BASE_ADDRESS + text_offset;
+    uint64_t data_address = ELF_BASE_ADDRESS + data_offset;
+    uint64_t bss_address = (data_address + code.Data.size() + 15) & ~uint64_t(15);
+
+    link_machine_code(code, text_address, data_address, bss_address);
+
+    Elf64_Ehdr header{};
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_entry = text_address;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_shoff = section_headers_offset;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = 2;
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = 5;
+    header.e_shstrndx = 4;
+
+    Elf64_Phdr segments[2]{};
+    segments[0].p_type = PT_LOAD;
+    segments[0].p_flags = PF_R | PF_X;
+    segments[0].p_offset = 0;
+    segments[0].p_vaddr = segments[0].p_paddr = ELF_BASE_ADDRESS;
+    segments[0].p_filesz = segments[0].p_memsz = text_offset + code.Text.size();
+    segments[0].p_align = ELF_PAGE_SIZE;
+
+    segments[1].p_type = PT_LOAD;
+    segments[1].p_flags = PF_R | PF_W;
+    segments[1].p_offset = data_offset;
+    segments[1].p_vaddr = segments[1].p_paddr = data_address;
+    segments[1].p_filesz = code.Data.size();
+    segments[1].p_memsz = bss_address + code.BssSize - data_address;
+    segments[1].p_align = ELF_PAGE_SIZE;
+
+    // Section headers aren't needed to run the program, but they let the usual tools inspect it
+    Elf64_Shdr sections[5]{};
+    sections[1] = {1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, text_address, text_offset, code.Text.size(), 0, 0, 16, 0};
+    sections[2] = {7, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, data_address, data_offset, code.Data.size(), 0, 0, 1, 0};
+    sections[3] = {13, SHT_NOBITS, SHF_ALLOC | SHF_WRITE, bss_address, data_offset + code.Data.size(), code.BssSize, 0, 0, 16, 0};
+    sections[4] = {18, SHT_STRTAB, 0, 0, names_offset, sizeof(section_names), 0, 0, 1, 0};
+
+    std::vector<uint8_t> image(section_headers_offset + sizeof(sections), 0);
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + sizeof(header), segments, sizeof(segments));
+    memcpy(image.data() + text_offset, code.Text.data(), code.Text.size());
+    if (!code.Data.empty()) memcpy(image.data() + data_offset, code.Data.data(), code.Data.size());
+    memcpy(image.data() + names_offset, section_names, sizeof(section_names));
+    memcpy(image.data() + section_headers_offset, sections, sizeof(sections));
+
+    std::ofstream out(output_file_path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+    {
+        compilation_error("Can't open file: " + output_file_path);
+        exit(1);
+    }
+
+    out.write(reinterpret_cast<const char*>(image.data()), std::streamsize(image.size()));
+    out.close();
+
+    std::filesystem::permissions(output_file_path,
+        std::filesystem::perms::owner_all | std::filesystem::perms::group_read | std::filesystem::perms::group_exec |
+        std::filesystem::perms::others_read | std::filesystem::perms::others_exec);
+}
+
+// Maps the program below 2GiB in this process and jumps to it. The program ends with the exit syscall,
+// so it never returns here, and it uses the current stack as its data stack
+void run_jit_linux_x86_64(const Assembler& a)
+{
+    MachineCode code = encode_linux_x86_64(a);
+
+    size_t text_size = (code.Text.size() + ELF_PAGE_SIZE - 1) & ~(ELF_PAGE_SIZE - 1);
+    size_t data_size = (code.Data.size() + 15) & ~size_t(15);
+    size_t total_size = text_size + ((data_size + code.BssSize + ELF_PAGE_SIZE - 1) & ~(ELF_PAGE_SIZE - 1));
+
+    void* memory = mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        compilation_error("Can't map memory for the program: " + string(strerror(errno)));
+        exit(1);
+    }
+
+    uint8_t* text = static_cast<uint8_t*>(memory);
+    uint8_t* data = text + text_size;
+
+    link_machine_code(code, uint64_t(text), uint64_t(data), uint64_t(data + data_size));
 
-        out << endl;
+    memcpy(text, code.Text.data(), code.Text.size());
+    if (!code.Data.empty()) memcpy(data, code.Data.data(), code.Data.size());
+
+    if (mprotect(text, text_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        compilation_error("Can't make the program executable: " + string(strerror(errno)));
+        exit(1);
     }
 
-    out << endl << "segment .bss" << endl;
-    out << "    mem resb 640000" << endl;
+    cout.flush();
+    cerr.flush();
+
+    reinterpret_cast<void (*)()>(text)();
+
+    assert(false, "Unreachable. Programs end with the exit syscall");
 }
 
-void compile(const string& compiler_path, const string& path, std::vector<Operation> program, bool run_after_compilation, bool silent_mode)
+void compile(const string& compiler_path, const string& path, const Program& program, bool run_after_compilation, bool silent_mode, bool optimize, Backend backend, OutputBuffering buffering)
 {
     string filename = trim_string(path, "." + FILE_EXTENSION);
 
@@ -1875,24 +6198,55 @@ void compile(const string& compiler_path, const string& path, std::vector<Operat
         exit(1);
     }
 
+    if (backend == Backend::INTERPRETER)
+    {
+        if (!silent_mode) cout << "[INFO] Interpreting" << endl;
+        interpret_program(program);
+    }
+
 #ifdef __x86_64__
     auto compilation_start = std::chrono::high_resolution_clock::now();
-    if (!silent_mode) cout << "[INFO] Generating assembly -> " << filename << ".asm" << endl;
     auto start = std::chrono::high_resolution_clock::now();
-    generate_nasm_linux_x86_64(filename + ".asm", std::move(program));
+    Assembler assembler = assemble_linux_x86_64(program, optimize, buffering);
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = duration_cast<std::chrono::nanoseconds>(stop - start);
-    if (!silent_mode) cout << "[INFO] Generating assembly took " << (float)duration.count() / 1000000000.0f << " secs" << endl;
+    if (!silent_mode) cout << "[INFO] Code generation took " << (float)duration.count() / 1000000000.0f << " secs" << endl;
 
-    if (!silent_mode) cout << "[INFO] Compiling assembly with NASM" << endl;
-    start = std::chrono::high_resolution_clock::now();
-    execute_command(silent_mode, "nasm -felf64 -o " + filename + ".o " + filename + ".asm");
-    stop = std::chrono::high_resolution_clock::now();
-    duration = duration_cast<std::chrono::nanoseconds>(stop - start);
-    if (!silent_mode) cout << "[INFO] Object file generated: " << filename << ".asm -> " << filename << ".o" << endl;
-    if (!silent_mode) cout << "[INFO] Object file generation took " << (float)duration.count() / 1000000000.0f << " secs" << endl;
+    if (backend == Backend::JIT)
+    {
+        if (!silent_mode) cout << "[INFO] Running in memory" << endl;
+        run_jit_linux_x86_64(assembler);
+    }
+
+    if (backend == Backend::NASM)
+    {
+        if (!silent_mode) cout << "[INFO] Generating assembly -> " << filename << ".asm" << endl;
+        start = std::chrono::high_resolution_clock::now();
+        generate_nasm_linux_x86_64(filename + ".asm", assembler, program);
+        stop = std::chrono::high_resolution_clock::now();
+        duration = duration_cast<std::chrono::nanoseconds>(stop - start);
+        if (!silent_mode) cout << "[INFO] Generating assembly took " << (float)duration.count() / 1000000000.0f << " secs" << endl;
+
+        if (!silent_mode) cout << "[INFO] Compiling assembly with NASM" << endl;
+        start = std::chrono::high_resolution_clock::now();
+        execute_command(silent_mode, "nasm -felf64 -o " + filename + ".o " + filename + ".asm");
+        stop = std::chrono::high_resolution_clock::now();
+        duration = duration_cast<std::chrono::nanoseconds>(stop - start);
+        if (!silent_mode) cout << "[INFO] Object file generated: " << filename << ".asm -> " << filename << ".o" << endl;
+        if (!silent_mode) cout << "[INFO] Object file generation took " << (float)duration.count() / 1000000000.0f << " secs" << endl;
+
+        execute_command(silent_mode, "ld -o " + filename + " " + filename + ".o");
+    }
+    else
+    {
+        if (!silent_mode) cout << "[INFO] Generating executable -> " << filename << endl;
+        start = std::chrono::high_resolution_clock::now();
+        generate_elf_linux_x86_64(filename, assembler);
+        stop = std::chrono::high_resolution_clock::now();
+        duration = duration_cast<std::chrono::nanoseconds>(stop - start);
+        if (!silent_mode) cout << "[INFO] Generating executable took " << (float)duration.count() / 1000000000.0f << " secs" << endl;
+    }
 
-    execute_command(silent_mode, "ld -o " + filename + " " + filename + ".o");
     if (!silent_mode) cout << "[INFO] Compiled to " << filename << endl;
     auto compilation_stop = std::chrono::high_resolution_clock::now();
     duration = duration_cast<std::chrono::nanoseconds>(compilation_stop - compilation_start);
@@ -1907,20 +6261,215 @@ void compile(const string& compiler_path, const string& path, std::vector<Operat
     exit(1);
 }
 
+// Files named by `use` at the start of a line. Found without lexing, so a broken input can't stop the others
+// from building. It's only a hint for what to parse before forking
+std::vector<string> used_file_names(const string& path)
+{
+    std::vector<string> names;
+    std::ifstream file(path);
+    string line;
+
+    while (std::getline(file, line))
+    {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line.compare(start, 4, "use ") != 0) continue;
+
+        size_t open = line.find('"', start + 4);
+        size_t close = open == string::npos ? open : line.find('"', open + 1);
+        if (close != string::npos) names.push_back(line.substr(open + 1, close - open - 1));
+    }
+
+    return names;
+}
+
+class CompilationJob
+{
+public:
+    string Path;
+    pid_t Pid = -1;
+    int Fds[2] = {-1, -1};
+    string Output[2];
+    int Status = 0;
+    bool IsFinished = false;
+};
+
+// Compiles every input in a process of its own, at most `jobs` at a time. Files used by more than one input
+// are parsed before forking when they parse at all, so the processes share a single copy of them. Errors still end a process with
+// `exit`, and only its input fails. Output and diagnostics of each input are printed together, in the order
+// of inputs. Returns the number of failed inputs
+int compile_programs(const std::vector<string>& paths, int jobs, const std::vector<string>& include_paths, const string& cache_directory, const std::function<void(Program&, const string&)>& build)
+{
+    Program shared;
+    ModuleGraph graph(include_paths);
+    graph.CacheDirectory = cache_directory;
+    graph.IncludeHash = hash_include_paths(include_paths);
+
+    std::map<string, int> users;
+    for (const string& path : paths)
+    {
+        std::unordered_set<string> used;
+        for (const string& name : used_file_names(path)) used.insert(graph.Includes.resolve(name));
+        for (const string& file : used) users[file]++;
+    }
+    for (const auto& [file, count] : users)
+    {
+        if (count < 2 || !std::filesystem::exists(file)) continue;
+
+        // A token at the start of the file stands for its `use` in every input, so it goes through the cache
+        // as any other used file
+        Token use_token(TokenType::STRING, file, Location(register_source_file(file), 1, 1));
+
+        // Parsing errors end the process, so the file is tried in a child first. A broken file is left to the
+        // inputs using it, and each of them fails on its own
+        cout.flush();
+        cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            load_module(graph, shared, file, &use_token);
+            exit(0);
+        }
+
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) continue;
+        load_module(graph, shared, file, &use_token);
+    }
+
+    std::vector<CompilationJob> queue(paths.size());
+    size_t started = 0;
+    size_t printed = 0;
+    int running = 0;
+    int failed = 0;
+
+    auto start = [&](CompilationJob& job) {
+        int out[2], err[2];
+        if (pipe(out) != 0 || pipe(err) != 0)
+        {
+            compilation_error("Could not create a pipe for `" + job.Path + "`");
+            exit(1);
+        }
+
+        cout.flush();
+        cerr.flush();
+        job.Pid = fork();
+        if (job.Pid < 0)
+        {
+            compilation_error("Could not start compilation of `" + job.Path + "`");
+            exit(1);
+        }
+
+        if (job.Pid == 0)
+        {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(err[1], STDERR_FILENO);
+            close(out[0]);
+            close(out[1]);
+            close(err[0]);
+            close(err[1]);
+            for (const CompilationJob& other : queue)
+            {
+                if (other.Fds[0] >= 0) close(other.Fds[0]);
+                if (other.Fds[1] >= 0) close(other.Fds[1]);
+            }
+
+            const Module& entry = load_module(graph, shared, job.Path, nullptr);
+            collect_operations(graph, shared, entry);
+            build(shared, job.Path);
+            cout.flush();
+            exit(0);
+        }
+
+        close(out[1]);
+        close(err[1]);
+        job.Fds[0] = out[0];
+        job.Fds[1] = err[0];
+        ++running;
+    };
+
+    while (printed < queue.size())
+    {
+        while (running < jobs && started < queue.size())
+        {
+            queue[started].Path = paths[started];
+            start(queue[started++]);
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<std::pair<size_t, int>> owners;
+        for (size_t k = printed; k < started; ++k)
+        {
+            for (int stream = 0; stream < 2; ++stream)
+            {
+                if (queue[k].Fds[stream] < 0) continue;
+                fds.push_back({queue[k].Fds[stream], POLLIN, 0});
+                owners.emplace_back(k, stream);
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+        {
+            compilation_error("Could not wait for compilation processes");
+            exit(1);
+        }
+
+        for (size_t f = 0; f < fds.size(); ++f)
+        {
+            if (fds[f].revents == 0) continue;
+
+            auto [k, stream] = owners[f];
+            CompilationJob& job = queue[k];
+            char buffer[4096];
+            ssize_t size = read(job.Fds[stream], buffer, sizeof(buffer));
+            if (size > 0)
+            {
+                job.Output[stream].append(buffer, size_t(size));
+                continue;
+            }
+
+            close(job.Fds[stream]);
+            job.Fds[stream] = -1;
+            if (job.Fds[0] >= 0 || job.Fds[1] >= 0) continue;
+
+            waitpid(job.Pid, &job.Status, 0);
+            job.IsFinished = true;
+            --running;
+        }
+
+        for (; printed < started && queue[printed].IsFinished; ++printed)
+        {
+            const CompilationJob& job = queue[printed];
+            cout << job.Output[0] << std::flush;
+            cerr << job.Output[1] << std::flush;
+            if (!WIFEXITED(job.Status) || WEXITSTATUS(job.Status) != 0) ++failed;
+        }
+    }
+
+    return failed;
+}
+
 int main(int argc, char* argv[])
 {
     assert(HumanizedOpTypes.size() == static_cast<int>(OpType::COUNT), "Exhaustive checking of humanized operations definition");
     assert(HumanizedDataTypes.size() == static_cast<int>(DataType::COUNT), "Exhaustive checking of humanized data types definition");
-    assert(BuiltInOps.size() == static_cast<int>(OpType::COUNT) - 2, "Exhaustive checking of built in operations definition");
+    assert(BuiltInOps.size() == static_cast<int>(OpType::COUNT) - 5, "Exhaustive checking of built in operations definition");
 
     std::vector<string> args(argv, argv + argc);
 
     string compiler_path = shift_vector(args);
     std::vector<string> include_paths = {"./std/", "./use/"};
-    string path;
+    std::vector<string> inputs;
     bool run_after_compilation = false;
     bool silent_mode = false;
     bool unsafe_mode = false;
+    bool optimize = false;
+    Backend backend = Backend::ELF;
+    OutputBuffering buffering = OutputBuffering::FULL;
+    string cache_directory = default_cache_directory();
+    int inline_threshold = -1;
+    int jobs = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
 
     if (args.empty())
     {
@@ -1936,6 +6485,53 @@ int main(int argc, char* argv[])
         if (arg == "-quiet") silent_mode = true;
         else if (arg == "-r") run_after_compilation = true;
         else if (arg == "-unsafe") unsafe_mode = true;
+        else if (arg == "-O") optimize = true;
+        else if (arg == "-nasm") backend = Backend::NASM;
+        else if (arg == "-jit") backend = Backend::JIT;
+        else if (arg == "-interpret") backend = Backend::INTERPRETER;
+        else if (arg == "-no-cache") cache_directory = "";
+        else if (arg == "-inline-threshold")
+        {
+            if (args.empty() || !string_to_int(args[0], inline_threshold) || inline_threshold < 0)
+            {
+                compilation_error("Expected non-negative number of operations after `-inline-threshold` flag");
+                exit(1);
+            }
+
+            shift_vector(args);
+        }
+        else if (arg == "-j")
+        {
+            if (args.empty() || !string_to_int(args[0], jobs) || jobs < 1)
+            {
+                compilation_error("Expected positive number of jobs after `-j` flag");
+                exit(1);
+            }
+
+            shift_vector(args);
+        }
+        else if (arg == "-buffering")
+        {
+            string mode = args.empty() ? "" : shift_vector(args);
+            if (mode == "full") buffering = OutputBuffering::FULL;
+            else if (mode == "line") buffering = OutputBuffering::LINE;
+            else if (mode == "none") buffering = OutputBuffering::NONE;
+            else
+            {
+                compilation_error("Expected `full`, `line` or `none` after `-buffering` flag");
+                exit(1);
+            }
+        }
+        else if (arg == "-cache")
+        {
+            if (args.empty())
+            {
+                compilation_error("No path provided after `-cache` flag");
+                exit(1);
+            }
+
+            cache_directory = shift_vector(args);
+        }
         else if (arg == "-I")
         {
             if (args.empty())
@@ -1946,34 +6542,79 @@ int main(int argc, char* argv[])
 
             include_paths.push_back(shift_vector(args));
         }
-        else path = arg;
+        else inputs.push_back(arg);
     }
 
-    std::filesystem::path file_path(path);
+    std::vector<string> paths;
+    for (const string& input : inputs)
+    {
+        if (!std::filesystem::is_directory(input))
+        {
+            paths.push_back(input);
+            continue;
+        }
+
+        std::vector<string> files;
+        for (const auto& entry : std::filesystem::directory_iterator(input))
+        {
+            if (entry.is_regular_file() && get_file_extension(entry.path().string()) == FILE_EXTENSION) files.push_back(entry.path().string());
+        }
+        std::sort(files.begin(), files.end());
+        paths.insert(paths.end(), files.begin(), files.end());
+    }
 
-    if (get_file_extension(file_path.string()) != FILE_EXTENSION)
+    bool has_invalid_path = paths.empty();
+    for (const string& path : paths)
     {
-        usage(compiler_path);
-        compilation_error("Compiler only supports files with `.wis` extension");
-        exit(1);
+        if (get_file_extension(path) != FILE_EXTENSION)
+        {
+            compilation_error("Compiler only supports files with `.wis` extension, got '" + path + "'");
+            has_invalid_path = true;
+        }
+        else if (!std::filesystem::exists(path))
+        {
+            compilation_error("File '" + path + "' doesn't exists");
+            has_invalid_path = true;
+        }
     }
 
-    if (!std::filesystem::exists(file_path))
+    if (has_invalid_path)
     {
         usage(compiler_path);
-        compilation_error("File '" + file_path.string() + "' doesn't exists");
+        if (paths.empty()) compilation_error("No files to compile");
         exit(1);
     }
 
-    std::vector<Token> tokens = lex_file(file_path.string());
+    auto build = [&](Program& program, const string& path) {
+        inline_bindings(program, inline_threshold);
+
+        crossreference_blocks(program);
 
-    std::vector<Operation> program = parse_tokens_as_operations(tokens, include_paths);
+        if (!unsafe_mode) type_check_program(program);
 
-    crossreference_blocks(program);
+        if (optimize)
+        {
+            fold_constants(program);
+            eliminate_dead_code(program);
+        }
+        else reduce_constant_strength(program);
 
-    if (!unsafe_mode) type_check_program(program);
+        compile(compiler_path, path, program, run_after_compilation, silent_mode, optimize, backend, buffering);
+    };
+
+    if (paths.size() == 1)
+    {
+        Program program = parse_program(paths[0], include_paths, cache_directory);
+        build(program, paths[0]);
+        return 0;
+    }
 
-    compile(compiler_path, path, program, run_after_compilation, silent_mode);
+    int failed = compile_programs(paths, jobs, include_paths, cache_directory, build);
+    if (failed > 0)
+    {
+        compilation_error(std::to_string(failed) + " of " + std::to_string(paths.size()) + " programs failed to compile");
+        exit(1);
+    }
 
     return 0;
 }
\ No newline at end of file